@@ -0,0 +1,656 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+/* xchpst: eXtended Change Process State
+ * A tool that is backwards compatible with chpst(8) from runit(8),
+ * offering additional options to harden process with namespace isolation
+ * and more. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <linux/magic.h>
+
+#include "xchpst.h"
+#include "options.h"
+#include "cgroup.h"
+
+static const char *cgroup_mounts[] = {
+  "/sys/fs/cgroup",
+  "/sys/fs/cgroup/unified", /* hybrid hierarchy */
+  NULL,
+};
+
+/* Locate the cgroup v2 hierarchy */
+static const char *cgroup_root(void) {
+  const char **mnt;
+  struct statfs fs;
+
+  for (mnt = cgroup_mounts; *mnt; mnt++)
+    if (statfs(*mnt, &fs) == 0 && fs.f_type == CGROUP2_SUPER_MAGIC)
+      return *mnt;
+  return NULL;
+}
+
+/* Resource controls written to the cgroup before the process enters it */
+static const struct {
+  const char *controller;
+  const char *file;
+  const char *const *value;
+  /* Also applied to the process itself, so the cgroup is optional */
+  bool per_task;
+} cgroup_controls[] = {
+  { "cpu", "cpu.max", (const char *const *) &opt.cpu_max, false },
+  { "cpu", "cpu.weight", &opt.cpu_weight, false },
+  { "cpu", "cpu.uclamp.min", (const char *const *) &opt.uclamp_min, true },
+  { "cpu", "cpu.uclamp.max", (const char *const *) &opt.uclamp_max, true },
+  { "pids", "pids.max", &opt.pids_max, false },
+  { "memory", "memory.low", &opt.memory_low, false },
+  { "memory", "memory.high", &opt.memory_high, false },
+  { "memory", "memory.max", &opt.memory_max, false },
+  { "memory", "memory.swap.max", &opt.memory_swap_max, false },
+  { "cpuset", "cpuset.cpus", (const char *const *) &opt.cpuset_cpus, false },
+  { "cpuset", "cpuset.mems", (const char *const *) &opt.cpuset_mems, false },
+  { "cpuset", "cpuset.cpus.partition", &opt.cpuset_partition, false },
+};
+#define max_cgroup_controls \
+  ((ssize_t) (sizeof cgroup_controls / sizeof *cgroup_controls))
+
+/* Files a delegatee needs to own, per cgroups(7) */
+static const char *delegated_files[] = {
+  "cgroup.procs",
+  "cgroup.threads",
+  "cgroup.subtree_control",
+  NULL,
+};
+
+/* Counters in memory.events reported when the child exits */
+static const char *memory_events[] = {
+  "low",
+  "high",
+  "max",
+  "oom",
+  "oom_kill",
+};
+#define max_memory_events \
+  ((ssize_t) (sizeof memory_events / sizeof *memory_events))
+
+/* The cgroup being supervised while the child runs */
+static int supervised_fd = -1;
+static int events_fd = -1;
+static long long events_seen[max_memory_events];
+
+/* Startup boost state */
+static struct {
+  bool active;
+  struct timespec started;
+  int ready_fd;
+} boost = { .ready_fd = -1 };
+
+/* Proactive reclaim state */
+static struct {
+  struct timespec last;
+  unsigned long long peak;
+  unsigned long long usage;
+} reclaim;
+
+int cgroup_write(int cgroup_fd, const char *file, const char *value) {
+  int fd;
+  int rc = -1;
+
+  fd = openat(cgroup_fd, file, O_WRONLY | O_CLOEXEC);
+  if (fd != -1) {
+    rc = dprintf(fd, "%s\n", value) > 0 ? 0 : -1;
+    close(fd);
+  }
+  return rc;
+}
+
+static ssize_t cgroup_read(int cgroup_fd, const char *file, char *buf, size_t len) {
+  ssize_t got = -1;
+  int fd;
+
+  fd = openat(cgroup_fd, file, O_RDONLY | O_CLOEXEC);
+  if (fd != -1) {
+    got = read(fd, buf, len - 1);
+    close(fd);
+  }
+  if (got > 0 && buf[got - 1] == '\n')
+    got--;
+  if (got >= 0)
+    buf[got] = '\0';
+  return got;
+}
+
+static int write_weights(int cgroup_fd, const char *cpu_weight,
+                         const char *io_weight) {
+  char line[32];
+
+  if (opt.startup_cpu_weight &&
+      cgroup_write(cgroup_fd, "cpu.weight", cpu_weight) == -1)
+    return -1;
+  snprintf(line, sizeof line, "default %s", io_weight);
+  if (opt.startup_io_weight &&
+      cgroup_write(cgroup_fd, "io.weight", line) == -1)
+    return -1;
+  return 0;
+}
+
+static bool startup_requested(void) {
+  return opt.startup_cpu_weight || opt.startup_io_weight;
+}
+
+static void enable_controller(int cgroup_fd, const char *controller,
+                              const char *child) {
+  char change[32];
+
+  snprintf(change, sizeof change, "+%s", controller);
+  if (cgroup_write(cgroup_fd, "cgroup.subtree_control", change) == -1)
+    fprintf(stderr, "could not enable %s controller for %s, %s\n",
+            controller, child, strerror(errno));
+}
+
+static void want_controller(const char **wanted, int *n, const char *controller) {
+  int i;
+
+  for (i = 0; i < *n && strcmp(wanted[i], controller); i++);
+  if (i == *n)
+    wanted[(*n)++] = controller;
+}
+
+/* Make the controllers needed by any resource controls available
+ * to the children of a cgroup */
+static void enable_controllers(int cgroup_fd, const char *child) {
+  const char *wanted[max_cgroup_controls + 4];
+  int n = 0;
+  int i;
+
+  for (i = 0; i < max_cgroup_controls; i++)
+    if (*cgroup_controls[i].value)
+      want_controller(wanted, &n, cgroup_controls[i].controller);
+  if (opt.startup_cpu_weight)
+    want_controller(wanted, &n, "cpu");
+  for (i = 0; i < opt.num_pressure_watches; i++)
+    if (opt.pressure_watches[i].action == PRESSURE_THROTTLE)
+      want_controller(wanted, &n, "cpu");
+  if (opt.num_io_controls || opt.startup_io_weight)
+    want_controller(wanted, &n, "io");
+  if (set(OPT_MEMORY_RECLAIM))
+    want_controller(wanted, &n, "memory");
+
+  for (i = 0; i < n; i++)
+    enable_controller(cgroup_fd, wanted[i], child);
+}
+
+/* Open a cgroup below a base directory, creating it as necessary */
+static int cgroup_create(const char *base, const char *path) {
+  char *components;
+  char *comp;
+  char *save;
+  int next;
+  int fd;
+
+  fd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "could not open cgroup base %s, %s\n", base, strerror(errno));
+    return -1;
+  }
+
+  components = strdup(path);
+  if (components == NULL) {
+    perror("strdup");
+    close(fd);
+    return -1;
+  }
+
+  for (comp = strtok_r(components, "/", &save);
+       fd != -1 && comp;
+       comp = strtok_r(NULL, "/", &save)) {
+    if (!strcmp(comp, ".") || !strcmp(comp, "..")) {
+      fprintf(stderr, "invalid cgroup path: %s\n", path);
+      close(fd);
+      fd = -1;
+      break;
+    }
+    enable_controllers(fd, comp);
+    if (mkdirat(fd, comp, 0755) == 0) {
+      if (is_verbose())
+        fprintf(stderr, "created cgroup %s\n", comp);
+    } else if (errno != EEXIST) {
+      fprintf(stderr, "could not create cgroup %s, %s\n", comp, strerror(errno));
+    }
+    next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (next == -1)
+      fprintf(stderr, "could not open cgroup %s, %s\n", comp, strerror(errno));
+    close(fd);
+    fd = next;
+  }
+
+  free(components);
+  return fd;
+}
+
+int cgroup_open(const char *path) {
+  const char *base = opt.cgroup_base;
+  const char *root = NULL;
+  char *full_base = NULL;
+  int fd;
+
+  if (*path == '/') {
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+      fprintf(stderr, "could not open cgroup %s, %s\n", path, strerror(errno));
+  } else {
+    if (base == NULL || *base != '/') {
+      root = cgroup_root();
+      if (root == NULL) {
+        fprintf(stderr, "cannot find cgroup v2 hierarchy\n");
+        return -1;
+      }
+      if (base && asprintf(&full_base, "%s/%s", root, base) == -1) {
+        perror("formatting cgroup path");
+        return -1;
+      }
+      base = full_base ? full_base : root;
+    }
+    fd = cgroup_create(base, path);
+  }
+
+  if (fd != -1 && is_verbose())
+    fprintf(stderr, "using cgroup %s%s%s\n",
+            *path == '/' ? "" : base, *path == '/' ? "" : "/", path);
+
+  free(full_base);
+  return fd;
+}
+
+/* Find the whole disk for a device given as MAJ:MIN or as a path to
+ * a block device or a file on one, since the io controller does not
+ * accept partitions */
+static bool block_device(const char *spec, char *dev, size_t len) {
+  unsigned int major, minor;
+  char path[64];
+  struct stat st;
+  int end = 0;
+  int fd;
+  ssize_t got;
+
+  if (sscanf(spec, "%u:%u%n", &major, &minor, &end) == 2 && spec[end] == '\0') {
+    snprintf(dev, len, "%u:%u", major, minor);
+  } else if (stat(spec, &st) == 0) {
+    if (!S_ISBLK(st.st_mode))
+      st.st_rdev = st.st_dev;
+    snprintf(dev, len, "%u:%u", major(st.st_rdev), minor(st.st_rdev));
+  } else {
+    fprintf(stderr, "could not find device %s, %s\n", spec, strerror(errno));
+    return false;
+  }
+
+  snprintf(path, sizeof path, "/sys/dev/block/%s/partition", dev);
+  if (access(path, F_OK) == -1) {
+    snprintf(path, sizeof path, "/sys/dev/block/%s", dev);
+    if (access(path, F_OK) == 0)
+      return true;
+    fprintf(stderr, "%s is not on a block device\n", spec);
+    return false;
+  }
+
+  snprintf(path, sizeof path, "/sys/dev/block/%s/../dev", dev);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  got = fd == -1 ? -1 : read(fd, dev, len - 1);
+  if (fd != -1)
+    close(fd);
+  if (got <= 0) {
+    fprintf(stderr, "could not find disk of partition %s\n", spec);
+    return false;
+  }
+  dev[strcspn(dev, "\n")] = '\0';
+  if (is_debug())
+    fprintf(stderr, "using whole disk %s for %s\n", dev, spec);
+  return true;
+}
+
+static int configure_io(int cgroup_fd) {
+  const struct io_control *control;
+  char dev[32];
+  char *line;
+  int rc;
+
+  for (control = opt.io_controls;
+       control - opt.io_controls < opt.num_io_controls;
+       control++) {
+    if (control->device == NULL)
+      strcpy(dev, "default");
+    else if (!block_device(control->device, dev, sizeof dev))
+      return -1;
+
+    if (asprintf(&line, "%s %s", dev, control->setting) == -1) {
+      perror("asprintf");
+      return -1;
+    }
+    rc = cgroup_write(cgroup_fd, control->file, line);
+    if (rc == -1)
+      fprintf(stderr, "could not set %s to %s, %s\n",
+              control->file, line, strerror(errno));
+    else if (is_verbose())
+      fprintf(stderr, "set %s to %s\n", control->file, line);
+    free(line);
+    if (rc == -1)
+      return -1;
+  }
+  return 0;
+}
+
+bool cgroup_controls_requested(void) {
+  int i;
+
+  if (opt.num_io_controls || startup_requested())
+    return true;
+
+  for (i = 0; i < max_cgroup_controls; i++)
+    if (*cgroup_controls[i].value && !cgroup_controls[i].per_task)
+      return true;
+  return false;
+}
+
+int cgroup_configure(int cgroup_fd) {
+  int i;
+
+  for (i = 0; i < max_cgroup_controls; i++) {
+    if (*cgroup_controls[i].value == NULL)
+      continue;
+    if (cgroup_write(cgroup_fd, cgroup_controls[i].file,
+                     *cgroup_controls[i].value) == -1) {
+      fprintf(stderr, "could not set %s to %s, %s\n",
+              cgroup_controls[i].file, *cgroup_controls[i].value,
+              strerror(errno));
+      return -1;
+    }
+    if (is_verbose())
+      fprintf(stderr, "set %s to %s\n",
+              cgroup_controls[i].file, *cgroup_controls[i].value);
+  }
+
+  /* An unusable partition is accepted, but reported on reading back */
+  if (opt.cpuset_partition) {
+    char state[256];
+
+    if (cgroup_read(cgroup_fd, "cpuset.cpus.partition", state, sizeof state) > 0 &&
+        strstr(state, "invalid")) {
+      fprintf(stderr, "cpuset partition not usable: %s\n", state);
+      return -1;
+    }
+  }
+  if (configure_io(cgroup_fd) == -1)
+    return -1;
+
+  /* Start boosted, so the child never runs with its steady-state
+   * weights first */
+  if (startup_requested()) {
+    if (write_weights(cgroup_fd, opt.startup_cpu_weight,
+                      opt.startup_io_weight) == -1) {
+      fprintf(stderr, "could not set startup weights, %s\n", strerror(errno));
+      return -1;
+    }
+    boost.active = true;
+  }
+  return 0;
+}
+
+int cgroup_delegate(int cgroup_fd, uid_t uid, gid_t gid) {
+  const char **file;
+
+  if (fchownat(cgroup_fd, "", uid, gid, AT_EMPTY_PATH) == -1)
+    goto fail;
+  for (file = delegated_files; *file; file++)
+    if (fchownat(cgroup_fd, *file, uid, gid, 0) == -1)
+      goto fail;
+  if (is_verbose())
+    fprintf(stderr, "delegated cgroup to %d:%d\n", uid, gid);
+  return 0;
+
+fail:
+  fprintf(stderr, "could not delegate cgroup, %s\n", strerror(errno));
+  return -1;
+}
+
+int cgroup_enter(int cgroup_fd) {
+  int fd;
+  int rc = -1;
+
+  fd = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+  if (fd != -1) {
+    /* Writing 0 migrates the writing process */
+    rc = write(fd, "0", 1) == 1 ? 0 : -1;
+    close(fd);
+  }
+  if (rc == -1)
+    fprintf(stderr, "could not enter cgroup, %s\n", strerror(errno));
+  return rc;
+}
+
+static bool read_memory_events(long long *counts) {
+  char buf[512];
+  char *line;
+  char *save;
+  char name[32];
+  long long count;
+  ssize_t len;
+  int i;
+
+  len = pread(events_fd, buf, sizeof buf - 1, 0);
+  if (len <= 0)
+    return false;
+  buf[len] = '\0';
+
+  for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+    if (sscanf(line, "%31s %lld", name, &count) != 2)
+      continue;
+    for (i = 0; i < max_memory_events && strcmp(name, memory_events[i]); i++);
+    if (i < max_memory_events)
+      counts[i] = count;
+  }
+  return true;
+}
+
+static bool read_counter(const char *file, const char *key,
+                         unsigned long long *value) {
+  char buf[1024];
+  char *line;
+  char *save;
+  size_t len = key ? strlen(key) : 0;
+
+  if (cgroup_read(supervised_fd, file, buf, sizeof buf) <= 0)
+    return false;
+  for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+    if (key == NULL ||
+        (!strncmp(line, key, len) && line[len] == ' ' && (line += len + 1)))
+      return sscanf(line, "%llu", value) == 1;
+  return false;
+}
+
+/* Take note of the cgroup to look after while the child runs, taking a
+ * baseline of memory events, or stop looking after it if -1. The cgroup
+ * may have no memory controller, in which case no events are watched. */
+void cgroup_supervise(int cgroup_fd, int ready_fd) {
+  if (events_fd != -1)
+    close(events_fd);
+  events_fd = -1;
+  supervised_fd = cgroup_fd;
+  boost.ready_fd = ready_fd;
+  if (cgroup_fd == -1)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &reclaim.last);
+  if (opt.reclaim_idle)
+    read_counter("cpu.stat", "usage_usec", &reclaim.usage);
+
+  events_fd = openat(cgroup_fd, "memory.events", O_RDONLY | O_CLOEXEC);
+  if (events_fd != -1 && !read_memory_events(events_seen)) {
+    close(events_fd);
+    events_fd = -1;
+  }
+}
+
+/* Report memory events since the baseline or last report */
+void cgroup_report_events(void) {
+  long long counts[max_memory_events];
+  bool any = false;
+  int i;
+
+  if (events_fd == -1)
+    return;
+
+  memcpy(counts, events_seen, sizeof counts);
+  if (!read_memory_events(counts))
+    return;
+
+  for (i = 0; i < max_memory_events; i++)
+    if (counts[i] != events_seen[i])
+      any = true;
+
+  if (any || is_verbose()) {
+    fprintf(stderr, "memory events:");
+    for (i = 0; i < max_memory_events; i++)
+      fprintf(stderr, " %s %lld", memory_events[i], counts[i] - events_seen[i]);
+    fprintf(stderr, "\n");
+  }
+  memcpy(events_seen, counts, sizeof counts);
+}
+
+static void shorten_timeout(long long *timeout, long long remaining) {
+  if (remaining < 0)
+    remaining = 0;
+  if (*timeout == -1 || remaining < *timeout)
+    *timeout = remaining;
+}
+
+/* How long the supervisor may wait before there is cgroup work to do */
+int cgroup_timeout(void) {
+  long long timeout = -1;
+
+  if (supervised_fd == -1)
+    return -1;
+  if (set(OPT_MEMORY_RECLAIM))
+    shorten_timeout(&timeout, opt.reclaim_interval * 1000LL - elapsed_ms(&reclaim.last));
+  if (boost.active && opt.startup_boost)
+    shorten_timeout(&timeout, opt.startup_boost * 1000LL - elapsed_ms(&boost.started));
+  return timeout;
+}
+
+/* Descriptors for the supervisor to wait on */
+int cgroup_pollfds(struct pollfd *fds, int max) {
+  int n = 0;
+
+  if (supervised_fd != -1 && boost.active && boost.ready_fd != -1 && n < max)
+    fds[n++] = (struct pollfd) { .fd = boost.ready_fd, .events = POLLIN };
+  return n;
+}
+
+/* Reclaim memory down to the target proportion of the peak seen so
+ * far, optionally only when the cgroup has been idle for the last
+ * interval and at no more than the given rate */
+static void reclaim_memory(void) {
+  unsigned long long current, peak, usage, target, amount;
+  long long interval = elapsed_ms(&reclaim.last);
+  char request[32];
+  bool idle = true;
+
+  clock_gettime(CLOCK_MONOTONIC, &reclaim.last);
+  if (!read_counter("memory.current", NULL, &current))
+    return;
+  if (read_counter("memory.peak", NULL, &peak) && peak > reclaim.peak)
+    reclaim.peak = peak;
+  if (current > reclaim.peak)
+    reclaim.peak = current;
+
+  if (opt.reclaim_idle && read_counter("cpu.stat", "usage_usec", &usage)) {
+    idle = (usage - reclaim.usage) / 10 < (unsigned long long) (interval * opt.reclaim_idle);
+    reclaim.usage = usage;
+  }
+
+  target = reclaim.peak / 100 * opt.reclaim_target;
+  if (!idle || current <= target)
+    return;
+
+  amount = current - target;
+  if (opt.reclaim_rate && amount > opt.reclaim_rate)
+    amount = opt.reclaim_rate;
+  snprintf(request, sizeof request, "%llu", amount);
+  if (cgroup_write(supervised_fd, "memory.reclaim", request) == -1 &&
+      errno != EAGAIN) {
+    fprintf(stderr, "could not reclaim memory, %s\n", strerror(errno));
+    return;
+  }
+
+  if (is_verbose() && read_counter("memory.current", NULL, &usage))
+    fprintf(stderr, "reclaimed %llu of %llu bytes requested\n",
+            usage < current ? current - usage : 0, amount);
+}
+
+/* Give the cgroup its startup weights while the child starts */
+void cgroup_boost(void) {
+  if (supervised_fd == -1 || !startup_requested())
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &boost.started);
+  if (!boost.active &&
+      write_weights(supervised_fd, opt.startup_cpu_weight,
+                    opt.startup_io_weight) == -1) {
+    fprintf(stderr, "could not set startup weights, %s\n", strerror(errno));
+    return;
+  }
+  boost.active = true;
+}
+
+/* Go over to the steady-state weights, as given by the usual options or
+ * else the kernel defaults */
+static void end_boost(const char *why) {
+  const char *io_weight = "100";
+  char buf[64];
+  int i;
+
+  for (i = 0; i < opt.num_io_controls; i++)
+    if (opt.io_controls[i].device == NULL &&
+        !strcmp(opt.io_controls[i].file, "io.weight"))
+      io_weight = opt.io_controls[i].setting;
+
+  while (boost.ready_fd != -1 && read(boost.ready_fd, buf, sizeof buf) > 0);
+
+  boost.active = false;
+  if (write_weights(supervised_fd, opt.cpu_weight ? opt.cpu_weight : "100",
+                    io_weight) == -1)
+    fprintf(stderr, "could not restore weights after startup, %s\n",
+            strerror(errno));
+  else if (is_verbose())
+    fprintf(stderr, "startup boost ended %s after %lld ms\n",
+            why, elapsed_ms(&boost.started));
+}
+
+/* Do any cgroup work that has fallen due or been signalled */
+void cgroup_service(const struct pollfd *fds, int nfds) {
+  int i;
+
+  if (supervised_fd == -1)
+    return;
+
+  for (i = 0; i < nfds; i++)
+    if (fds[i].fd == boost.ready_fd && fds[i].revents && boost.active)
+      end_boost("on readiness");
+
+  if (boost.active && opt.startup_boost &&
+      elapsed_ms(&boost.started) >= opt.startup_boost * 1000LL)
+    end_boost("by timeout");
+
+  if (set(OPT_MEMORY_RECLAIM) &&
+      elapsed_ms(&reclaim.last) >= opt.reclaim_interval * 1000LL)
+    reclaim_memory();
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _CGROUP_H
+#define _CGROUP_H
+
+extern int cgroup_open(const char *path);
+extern int cgroup_enter(int cgroup_fd);
+extern int cgroup_write(int cgroup_fd, const char *file, const char *value);
+extern bool cgroup_controls_requested(void);
+extern int cgroup_configure(int cgroup_fd);
+extern int cgroup_delegate(int cgroup_fd, uid_t uid, gid_t gid);
+#include <poll.h>
+
+/* Most descriptors the supervisor waits on for cgroup work */
+#define MAX_CGROUP_POLLFDS 4
+
+extern void cgroup_supervise(int cgroup_fd, int ready_fd);
+extern void cgroup_boost(void);
+extern void cgroup_report_events(void);
+extern int cgroup_timeout(void);
+extern int cgroup_pollfds(struct pollfd *fds, int max);
+extern void cgroup_service(const struct pollfd *fds, int nfds);
+
+#endif
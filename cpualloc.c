@@ -0,0 +1,532 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+/* xchpst: eXtended Change Process State
+ * A tool that is backwards compatible with chpst(8) from runit(8),
+ * offering additional options to harden process with namespace isolation
+ * and more. */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/sysinfo.h>
+
+#include "xchpst.h"
+#include "options.h"
+#include "topology.h"
+#include "cpualloc.h"
+
+/* Window over which CPU utilisation is measured */
+#define AUTO_SAMPLE_MS 100
+
+/* How long a pick recorded with --cpus-spread counts against a CPU */
+#define RECENT_PICK_MS 10000
+
+static const char *recent_picks_file = "cpus-auto";
+static const char *exclusive_file = "cpus-exclusive";
+
+struct cpu_load {
+  int cpu;
+  double busy;
+};
+
+/* Read cumulative busy and total ticks for each online CPU */
+static bool read_stat(int num, unsigned long long *busy,
+                      unsigned long long *total) {
+  unsigned long long t[8];
+  char line[256];
+  bool good = true;
+  int cpu;
+  int i;
+  FILE *f;
+
+  f = fopen("/proc/stat", "re");
+  if (f == NULL) {
+    perror("could not open /proc/stat");
+    return false;
+  }
+  memset(t, 0, sizeof t);
+  /* Skip the aggregate line, or %d would read its first count as a CPU */
+  while (fgets(line, sizeof line, f))
+    if (!strncmp(line, "cpu", 3) && isdigit((unsigned char) line[3]) &&
+        sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu",
+               &cpu, &t[0], &t[1], &t[2], &t[3],
+               &t[4], &t[5], &t[6], &t[7]) >= 5 &&
+        cpu >= 0 && cpu < num) {
+      /* Guest time is already counted in user and nice */
+      for (total[cpu] = 0, i = 0; i < 8; i++)
+        total[cpu] += t[i];
+      busy[cpu] = total[cpu] - t[3] - t[4];
+    }
+  if (ferror(f)) {
+    perror("could not read /proc/stat");
+    good = false;
+  }
+  fclose(f);
+  return good;
+}
+
+static int by_busy(const void *a, const void *b) {
+  const struct cpu_load *x = a;
+  const struct cpu_load *y = b;
+
+  if (x->busy != y->busy)
+    return x->busy < y->busy ? -1 : 1;
+  return x->cpu - y->cpu;
+}
+
+/* Measure the utilisation of each allowed CPU, returning the number
+ * of candidates found */
+static int sample(const struct cpu_mask *allowed, struct cpu_load *loads,
+                  int num) {
+  unsigned long long *busy0, *total0, *busy1, *total1;
+  struct timespec delay = {
+    .tv_sec = AUTO_SAMPLE_MS / 1000,
+    .tv_nsec = (AUTO_SAMPLE_MS % 1000) * 1000000
+  };
+  int count = -1;
+  int cpu;
+
+  busy0 = calloc(4 * num, sizeof *busy0);
+  if (busy0 == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  total0 = busy0 + num;
+  busy1 = total0 + num;
+  total1 = busy1 + num;
+
+  if (!read_stat(num, busy0, total0))
+    goto finish;
+  nanosleep(&delay, NULL);
+  if (!read_stat(num, busy1, total1))
+    goto finish;
+
+  for (count = 0, cpu = 0; cpu < num; cpu++) {
+    /* Offline CPUs are absent from /proc/stat */
+    if (total1[cpu] == 0 ||
+        cpu >= allowed->size * 8 ||
+        !CPU_ISSET_S(cpu, allowed->size, allowed->mask))
+      continue;
+    loads[count].cpu = cpu;
+    loads[count].busy = total1[cpu] > total0[cpu] ?
+      (double) (busy1[cpu] - busy0[cpu]) / (total1[cpu] - total0[cpu]) : 0.0;
+    count++;
+  }
+
+finish:
+  free(busy0);
+  return count;
+}
+
+/* Penalise CPUs handed out recently by other invocations, keeping only
+ * those records still young enough to matter */
+static void weigh_recent_picks(FILE *f, struct cpu_load *loads, int count,
+                               char **kept, size_t *kept_len) {
+  long long now = elapsed_ms(NULL);
+  long long when;
+  FILE *out;
+  int cpu;
+  int i;
+
+  out = open_memstream(kept, kept_len);
+  if (out == NULL)
+    return;
+  while (fscanf(f, "%lld %d", &when, &cpu) == 2) {
+    if (when > now || now - when > RECENT_PICK_MS)
+      continue;
+    fprintf(out, "%lld %d\n", when, cpu);
+    for (i = 0; i < count; i++)
+      if (loads[i].cpu == cpu)
+        loads[i].busy += 1.0;
+  }
+  fclose(out);
+}
+
+static void record_picks(FILE *f, const char *kept,
+                         const struct cpu_mask *picked) {
+  long long now = elapsed_ms(NULL);
+  int cpu;
+
+  if (ftruncate(fileno(f), 0) == -1 || fseek(f, 0, SEEK_SET) == -1)
+    return;
+  if (kept)
+    fputs(kept, f);
+  for (cpu = 0; cpu < picked->size * 8; cpu++)
+    if (CPU_ISSET_S(cpu, picked->size, picked->mask))
+      fprintf(f, "%lld %d\n", now, cpu);
+  fflush(f);
+}
+
+/* Take the n quietest candidates, preferring a thread from each core
+ * before doubling up on SMT siblings */
+static void pick(const struct cpu_load *loads, int count, int n, int num,
+                 struct cpu_mask *picked) {
+  cpu_set_t *cores;
+  size_t size = CPU_ALLOC_SIZE(num);
+  int core;
+  int i;
+
+  cores = CPU_ALLOC(num);
+  if (cores)
+    CPU_ZERO_S(size, cores);
+  for (i = 0; cores && n && i < count; i++) {
+    core = topology_core(loads[i].cpu);
+    if (core < 0 || core >= num || CPU_ISSET_S(core, size, cores))
+      continue;
+    CPU_SET_S(core, size, cores);
+    CPU_SET_S(loads[i].cpu, picked->size, picked->mask);
+    n--;
+  }
+  for (i = 0; n && i < count; i++)
+    if (!CPU_ISSET_S(loads[i].cpu, picked->size, picked->mask)) {
+      CPU_SET_S(loads[i].cpu, picked->size, picked->mask);
+      n--;
+    }
+  if (cores)
+    CPU_FREE(cores);
+}
+
+/* Candidates are the given pool, the CPUs of a followed NUMA node or
+ * else wherever we may already run */
+static bool get_pool(struct cpu_mask *pool, bool *owned, int num) {
+  *owned = false;
+  if (opt.cpus_pool.size) {
+    *pool = opt.cpus_pool;
+  } else if (opt.cpu_affinity.size) {
+    *pool = opt.cpu_affinity;
+  } else {
+    pool->size = CPU_ALLOC_SIZE(num);
+    pool->mask = CPU_ALLOC(num);
+    if (pool->mask == NULL) {
+      perror("CPU_ALLOC");
+      return false;
+    }
+    *owned = true;
+    if (sched_getaffinity(0, pool->size, pool->mask) == -1) {
+      perror("could not get CPU affinity");
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool new_mask(struct cpu_mask *mask, int num) {
+  mask->size = CPU_ALLOC_SIZE(num);
+  mask->mask = CPU_ALLOC(num);
+  if (mask->mask == NULL) {
+    perror("CPU_ALLOC");
+    mask->size = 0;
+    return false;
+  }
+  CPU_ZERO_S(mask->size, mask->mask);
+  return true;
+}
+
+static void set_affinity(struct cpu_mask *mask, const char *what) {
+  if (opt.cpu_affinity.size)
+    CPU_FREE(opt.cpu_affinity.mask);
+  opt.cpu_affinity = *mask;
+  mask->size = 0;
+
+  if (is_verbose()) {
+    char *list = format_cpus(&opt.cpu_affinity);
+    fprintf(stderr, "chose %s %s\n", what, list ? list : "?");
+    free(list);
+  }
+}
+
+/* Open and lock a registry shared between invocations */
+static FILE *open_registry(const char *name) {
+  FILE *f = NULL;
+  int fd;
+
+  if (get_run_dir() == -1)
+    return NULL;
+  fd = openat(get_run_dir(), name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1 || (f = fdopen(fd, "r+")) == NULL) {
+    fprintf(stderr, "could not open %s/%s, %s\n",
+            run_dir, name, strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return NULL;
+  }
+  if (flock(fd, LOCK_EX) == -1) {
+    fprintf(stderr, "could not lock %s/%s, %s\n",
+            run_dir, name, strerror(errno));
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+int cpualloc_auto(void) {
+  struct cpu_mask allowed = { 0 };
+  struct cpu_mask picked = { 0 };
+  struct cpu_load *loads = NULL;
+  bool own_allowed;
+  char *kept = NULL;
+  size_t kept_len = 0;
+  FILE *picks = NULL;
+  int num = get_nprocs_conf();
+  int count;
+  int rc = -1;
+
+  if (!get_pool(&allowed, &own_allowed, num))
+    goto finish;
+
+  loads = calloc(num, sizeof *loads);
+  if (loads == NULL) {
+    perror("calloc");
+    goto finish;
+  }
+
+  /* Serialise with concurrent invocations so each sees the others' picks */
+  if (opt.cpus_spread && (picks = open_registry(recent_picks_file)) == NULL)
+    goto finish;
+
+  if ((count = sample(&allowed, loads, num)) == -1)
+    goto finish;
+  if (count < opt.cpus_auto) {
+    fprintf(stderr, "only %d CPU%s available to choose %d from\n",
+            count, count == 1 ? "" : "s", opt.cpus_auto);
+    goto finish;
+  }
+  if (picks)
+    weigh_recent_picks(picks, loads, count, &kept, &kept_len);
+  qsort(loads, count, sizeof *loads, by_busy);
+
+  if (!new_mask(&picked, num))
+    goto finish;
+  pick(loads, count, opt.cpus_auto, num, &picked);
+
+  if (picks)
+    record_picks(picks, kept, &picked);
+
+  set_affinity(&picked, "quietest CPUs");
+  rc = 0;
+
+finish:
+  if (picks)
+    fclose(picks);
+  free(kept);
+  free(loads);
+  if (own_allowed)
+    CPU_FREE(allowed.mask);
+  return rc;
+}
+
+static bool owner_alive(pid_t pid, unsigned long long start) {
+  unsigned long long actual;
+
+  return process_start_time(pid, &actual) && actual == start;
+}
+
+struct free_core {
+  int core;
+  int llc;
+  int llc_free;
+};
+
+static int by_llc(const void *a, const void *b) {
+  const struct free_core *x = a;
+  const struct free_core *y = b;
+
+  if (x->llc_free != y->llc_free)
+    return y->llc_free - x->llc_free;
+  if (x->llc != y->llc)
+    return x->llc - y->llc;
+  return x->core - y->core;
+}
+
+/* Choose n cores, from a single last level cache if any has enough
+ * free and preferring the tightest fit, otherwise from the caches with
+ * most free cores first. */
+static void choose_cores(struct free_core *cores, int count, int n) {
+  int best = -1;
+  int i, j;
+
+  for (i = 0; i < count; i++) {
+    for (cores[i].llc_free = 0, j = 0; j < count; j++)
+      if (cores[j].llc == cores[i].llc)
+        cores[i].llc_free++;
+    if (cores[i].llc_free >= n &&
+        (best == -1 || cores[i].llc_free < cores[best].llc_free))
+      best = i;
+  }
+  if (best != -1)
+    for (i = 0; i < count; i++)
+      if (cores[i].llc == cores[best].llc)
+        cores[i].llc_free = count + 1;
+  qsort(cores, count, sizeof *cores, by_llc);
+}
+
+/* Rewrite the registry without dead owners, returning the CPUs held */
+static bool reclaim(FILE *f, int num, struct cpu_mask *held) {
+  unsigned long long start;
+  char *kept = NULL;
+  size_t kept_len = 0;
+  pid_t pid;
+  FILE *out;
+  int cpu;
+
+  out = open_memstream(&kept, &kept_len);
+  if (out == NULL) {
+    perror("open_memstream");
+    return false;
+  }
+  while (fscanf(f, "%d %d %llu", &cpu, &pid, &start) == 3) {
+    if (cpu < 0 || cpu >= num)
+      continue;
+    if (!owner_alive(pid, start)) {
+      if (is_verbose())
+        fprintf(stderr, "reclaimed CPU %d from exited process %d\n", cpu, pid);
+      continue;
+    }
+    fprintf(out, "%d %d %llu\n", cpu, pid, start);
+    CPU_SET_S(cpu, held->size, held->mask);
+  }
+  fclose(out);
+
+  if (ftruncate(fileno(f), 0) == -1 || fseek(f, 0, SEEK_SET) == -1) {
+    perror("could not rewrite exclusive CPU registry");
+    free(kept);
+    return false;
+  }
+  if (kept)
+    fputs(kept, f);
+  free(kept);
+  return true;
+}
+
+int cpualloc_exclusive(void) {
+  struct cpu_mask pool = { 0 };
+  struct cpu_mask held = { 0 };
+  struct cpu_mask taken = { 0 };
+  struct cpu_mask picked = { 0 };
+  struct free_core *cores = NULL;
+  unsigned long long start;
+  bool own_pool = false;
+  FILE *registry = NULL;
+  int num = get_nprocs_conf();
+  int count = 0;
+  int core;
+  int cpu;
+  int rc = -1;
+  int i;
+
+  if (!get_pool(&pool, &own_pool, num) ||
+      !new_mask(&held, num) ||
+      !new_mask(&taken, num) ||
+      !new_mask(&picked, num))
+    goto finish;
+
+  if (!process_start_time(getpid(), &start)) {
+    fprintf(stderr, "could not identify own process\n");
+    goto finish;
+  }
+
+  cores = calloc(num, sizeof *cores);
+  if (cores == NULL) {
+    perror("calloc");
+    goto finish;
+  }
+
+  if ((registry = open_registry(exclusive_file)) == NULL ||
+      !reclaim(registry, num, &held))
+    goto finish;
+
+  /* A core is only free if none of its threads is held */
+  for (cpu = 0; cpu < num; cpu++)
+    if (CPU_ISSET_S(cpu, held.size, held.mask))
+      CPU_SET_S(topology_core(cpu), taken.size, taken.mask);
+  for (cpu = 0; cpu < num && cpu < pool.size * 8; cpu++) {
+    if (!CPU_ISSET_S(cpu, pool.size, pool.mask))
+      continue;
+    core = topology_core(cpu);
+    if (core < 0 || core >= num || CPU_ISSET_S(core, taken.size, taken.mask))
+      continue;
+    CPU_SET_S(core, taken.size, taken.mask);
+    cores[count].core = core;
+    cores[count].llc = topology_llc(cpu);
+    count++;
+  }
+  if (count < opt.cpus_exclusive) {
+    fprintf(stderr, "only %d free core%s for --cpus exclusive:%d\n",
+            count, count == 1 ? "" : "s", opt.cpus_exclusive);
+    goto finish;
+  }
+  choose_cores(cores, count, opt.cpus_exclusive);
+
+  /* Take every thread of the chosen cores that lies in the pool */
+  for (cpu = 0; cpu < num && cpu < pool.size * 8; cpu++) {
+    if (!CPU_ISSET_S(cpu, pool.size, pool.mask))
+      continue;
+    core = topology_core(cpu);
+    for (i = 0; i < opt.cpus_exclusive && cores[i].core != core; i++);
+    if (i == opt.cpus_exclusive)
+      continue;
+    CPU_SET_S(cpu, picked.size, picked.mask);
+    fprintf(registry, "%d %d %llu\n", cpu, getpid(), start);
+  }
+  if (fflush(registry) == EOF) {
+    perror("could not record exclusive CPUs");
+    goto finish;
+  }
+
+  set_affinity(&picked, "exclusive CPUs");
+  rc = 0;
+
+finish:
+  if (registry)
+    fclose(registry);
+  free(cores);
+  if (own_pool)
+    CPU_FREE(pool.mask);
+  if (held.size)
+    CPU_FREE(held.mask);
+  if (taken.size)
+    CPU_FREE(taken.mask);
+  if (picked.size)
+    CPU_FREE(picked.mask);
+  return rc;
+}
+
+/* Hand our exclusive CPUs to a detached child that outlives us */
+void cpualloc_transfer(pid_t child) {
+  unsigned long long own_start, child_start;
+  unsigned long long start;
+  char *kept = NULL;
+  size_t kept_len = 0;
+  FILE *registry;
+  FILE *out;
+  pid_t pid;
+  int cpu;
+
+  if (!process_start_time(getpid(), &own_start) ||
+      !process_start_time(child, &child_start) ||
+      (registry = open_registry(exclusive_file)) == NULL)
+    return;
+
+  out = open_memstream(&kept, &kept_len);
+  if (out != NULL) {
+    while (fscanf(registry, "%d %d %llu", &cpu, &pid, &start) == 3)
+      if (pid == getpid() && start == own_start)
+        fprintf(out, "%d %d %llu\n", cpu, child, child_start);
+      else
+        fprintf(out, "%d %d %llu\n", cpu, pid, start);
+    fclose(out);
+    if (ftruncate(fileno(registry), 0) == 0 &&
+        fseek(registry, 0, SEEK_SET) == 0 && kept)
+      fputs(kept, registry);
+    free(kept);
+  }
+  fclose(registry);
+}
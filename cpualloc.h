@@ -0,0 +1,11 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _CPUALLOC_H
+#define _CPUALLOC_H
+
+extern int cpualloc_auto(void);
+extern int cpualloc_exclusive(void);
+extern void cpualloc_transfer(pid_t child);
+
+#endif
@@ -8,56 +8,157 @@
 
 #include <poll.h>
 #include <signal.h>
+#include <time.h>
+#include <linux/ioprio.h>
 #include <linux/prctl.h>
+#include <linux/sched.h>
 #include <sys/file.h>
 #include <sys/pidfd.h>
 #include <sys/signalfd.h>
+#include <sys/sysinfo.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 #include "xchpst.h"
 #include "join.h"
+#include "cgroup.h"
+#include "psi.h"
+#include "schedule.h"
 
-bool join(pid_t child, sigset_t *mask, sigset_t *oldmask, int *retcode) {
+/* Whether a signal asking the child to stop has been passed on */
+static bool stopping = false;
+
+/* Workload scheduling state, saved while the supervisor uses its own */
+static struct {
+  bool saved;
+  cpu_set_t *affinity;
+  size_t affinity_size;
+  struct sched_attributes attr;
+  int ioprio;
+} workload;
+
+/* Missing in glibc */
+static pid_t clone3(struct clone_args *args) {
+  return syscall(SYS_clone3, args, sizeof *args);
+}
+
+pid_t launch(uint64_t flags, int cgroup_fd, int *pidfd) {
+  struct clone_args args = {
+    .flags = flags | CLONE_PIDFD,
+    .pidfd = (uintptr_t) pidfd,
+    /* A sibling notifies our parent as we would */
+    .exit_signal = flags & CLONE_PARENT ? 0 : SIGCHLD,
+  };
+  pid_t child;
+
+  /* Start the child off in its cgroup rather than migrating it later */
+  if (cgroup_fd != -1) {
+    args.flags |= CLONE_INTO_CGROUP;
+    args.cgroup = cgroup_fd;
+  }
+
+  child = clone3(&args);
+  if (child == -1)
+    perror("clone3");
+  else if (child != 0 && is_verbose())
+    fprintf(stderr, "launched child %d\n", child);
+
+  return child;
+}
+
+static void exit_status(const siginfo_t *inf, int *retcode) {
+  if (inf->si_code == CLD_KILLED || inf->si_code == CLD_DUMPED) {
+    if (is_verbose())
+      fprintf(stderr, "child killed by signal %d\n", inf->si_status);
+    *retcode = 128 + inf->si_status;
+  } else if (inf->si_code == CLD_EXITED) {
+    *retcode = inf->si_status;
+  }
+}
+
+/* Reap every child that has exited, as a subreaper or PID 1 inherits
+ * orphans. Returns true if the main child was among them. */
+static bool reap(pid_t child, int *retcode, unsigned long *reaped) {
+  siginfo_t inf;
+  bool done = false;
+
+  while (true) {
+    inf.si_pid = 0;
+    if (waitid(P_ALL, 0, &inf, WEXITED | WNOHANG) == -1) {
+      if (errno != ECHILD)
+        perror("waitid");
+      break;
+    }
+    if (inf.si_pid == 0)
+      break;
+    if (inf.si_pid == child) {
+      exit_status(&inf, retcode);
+      done = true;
+    } else {
+      (*reaped)++;
+      if (is_debug())
+        fprintf(stderr, "reaped orphan %d\n", inf.si_pid);
+    }
+  }
+  return done;
+}
+
+/* The sooner of two poll timeouts, where -1 is forever */
+static int earlier_timeout(int a, int b) {
+  return a == -1 || (b != -1 && b < a) ? b : a;
+}
+
+bool join(pid_t child, int pidfd, sigset_t *mask, sigset_t *oldmask, int *retcode) {
   enum {
     /* Offsets into poll set */
     my_pidfd = 0,
-    my_signalfd = 1
+    my_signalfd = 1,
+    my_cgroup = 2
   };
   struct signalfd_siginfo siginf;
   siginfo_t pidinf;
+  unsigned long reaped = 0;
+  bool reaping = set(OPT_REAP);
+  bool done = false;
   int ready;
   int sfd;
-  int pidfd;
   int rc;
 
-  pidfd = pidfd_open(child, PIDFD_NONBLOCK);
-  if (pidfd == -1) {
-    perror("error setting up child supervision");
-    kill(child, SIGKILL);
-    return false;
-  }
-
   sfd = signalfd(-1, mask, SFD_NONBLOCK);
   if (sfd == -1) {
-    close(pidfd);
     perror("error setting up signal proxy");
     pidfd_send_signal(pidfd, SIGKILL, NULL, 0);
+    close(pidfd);
     return false;
   }
 
-  struct pollfd pollset[2] = {
+  struct pollfd pollset[my_cgroup + MAX_CGROUP_POLLFDS + MAX_PRESSURE_WATCHES] = {
     [my_pidfd] = { .fd = pidfd, .events = POLLIN },
     [my_signalfd] = { .fd = sfd, .events = POLLIN },
   };
+  struct pollfd *my_psi;
+  int ncgroup, npsi;
+  int timeout;
+
+  while(!done) {
+    ncgroup = cgroup_pollfds(pollset + my_cgroup, MAX_CGROUP_POLLFDS);
+    my_psi = pollset + my_cgroup + ncgroup;
+    npsi = psi_pollfds(my_psi, MAX_PRESSURE_WATCHES);
+    timeout = earlier_timeout(cgroup_timeout(), psi_timeout());
 
-  while(true) {
-    ready = poll(pollset, 2, -1);
+    ready = poll(pollset, my_cgroup + ncgroup + npsi, timeout);
+    cgroup_service(pollset + my_cgroup, ready > 0 ? ncgroup : 0);
+    psi_service(my_psi, ready > 0 ? npsi : 0, child, pidfd);
     if (ready == -1 && errno != EINTR) {
       perror("poll");
     } else if (ready != 0) {
       if (pollset[my_pidfd].revents & POLLIN) {
 
         /* Handle event on pidfd */
+        if (reaping) {
+          done = reap(child, retcode, &reaped);
+          continue;
+        }
         pidinf.si_pid = 0;
         pidinf.si_signo = 0;
         rc = waitid(P_PIDFD, pidfd, &pidinf, WEXITED | WNOHANG);
@@ -66,13 +167,7 @@ bool join(pid_t child, sigset_t *mask, sigset_t *oldmask, int *retcode) {
         } else if (rc == 0 &&
                  pidinf.si_signo == SIGCHLD &&
                  pidinf.si_pid == child) {
-          if (pidinf.si_code == CLD_KILLED || pidinf.si_code == CLD_DUMPED) {
-            if (is_verbose())
-              fprintf(stderr, "child killed by signal %d\n", pidinf.si_status);
-            *retcode = 128 + pidinf.si_status;
-          } else if (pidinf.si_code == CLD_EXITED) {
-            *retcode = pidinf.si_code;
-          }
+          exit_status(&pidinf, retcode);
           break;
         } else {
           fprintf(stderr, "got SIGCHLD from someone else's child (%d)!\n",
@@ -88,15 +183,31 @@ bool join(pid_t child, sigset_t *mask, sigset_t *oldmask, int *retcode) {
           perror("read signalfd");
           break;
         }
+        if (siginf.ssi_signo == SIGCHLD) {
+          /* Only blocked when reaping orphans */
+          done = reap(child, retcode, &reaped);
+          continue;
+        }
+        if (siginf.ssi_signo == SIGTERM ||
+            siginf.ssi_signo == SIGINT ||
+            siginf.ssi_signo == SIGQUIT)
+          stopping = true;
         if (is_verbose())
-          fprintf(stderr, "passing on signal %d to child\n", siginf.ssi_signo);
-        pidfd_send_signal(pidfd, siginf.ssi_signo, NULL, 0);
+          fprintf(stderr, "passing on signal %d to child%s\n", siginf.ssi_signo,
+                  set(OPT_SIGNAL_GROUP) ? " process group" : "");
+        if (set(OPT_SIGNAL_GROUP))
+          kill(-child, siginf.ssi_signo);
+        else
+          pidfd_send_signal(pidfd, siginf.ssi_signo, NULL, 0);
       }
     }
   }
 
-  if (is_verbose())
+  if (is_verbose()) {
     fprintf(stderr, "child terminated; cleaning up\n");
+    if (reaping)
+      fprintf(stderr, "reaped %lu orphaned processes\n", reaped);
+  }
 
   close(sfd);
   close(pidfd);
@@ -104,3 +215,191 @@ bool join(pid_t child, sigset_t *mask, sigset_t *oldmask, int *retcode) {
 
   return true;
 }
+
+/* Sleep, giving up early if asked to stop */
+static bool backoff(int delay, sigset_t *mask, sigset_t *oldmask) {
+  struct signalfd_siginfo siginf;
+  struct timespec started;
+  struct pollfd pollfd;
+  long long remaining = delay;
+  int ready;
+
+  if (sigprocmask(SIG_SETMASK, mask, NULL) == -1 ||
+      (pollfd.fd = signalfd(-1, mask, SFD_NONBLOCK)) == -1) {
+    perror("error setting up signal handling for backoff");
+    return false;
+  }
+  pollfd.events = POLLIN;
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  while (!stopping && remaining > 0) {
+    ready = poll(&pollfd, 1, remaining);
+    if (ready == -1 && errno != EINTR) {
+      perror("poll");
+      stopping = true;
+    }
+    while (ready > 0 && read(pollfd.fd, &siginf, sizeof siginf) == sizeof siginf) {
+      if (siginf.ssi_signo == SIGTERM ||
+          siginf.ssi_signo == SIGINT ||
+          siginf.ssi_signo == SIGQUIT)
+        stopping = true;
+    }
+    remaining = delay - elapsed_ms(&started);
+  }
+
+  close(pollfd.fd);
+  sigprocmask(SIG_SETMASK, oldmask, NULL);
+  return !stopping;
+}
+
+bool respawn(int retcode, const struct timespec *started,
+             sigset_t *mask, sigset_t *oldmask) {
+  static struct timespec *history = NULL;
+  static int restarts = 0;
+  static int delay = 0;
+  long long ran = elapsed_ms(started);
+  struct timespec *oldest;
+
+  if (stopping || retcode == 0)
+    goto done;
+
+  if (history == NULL &&
+      (history = calloc(opt.respawn_burst, sizeof *history)) == NULL) {
+    perror("calloc");
+    goto done;
+  }
+
+  /* Give up if the last burst of restarts all fell within the interval */
+  oldest = &history[restarts % opt.respawn_burst];
+  if (restarts >= opt.respawn_burst &&
+      elapsed_ms(oldest) < opt.respawn_interval * 1000LL) {
+    fprintf(stderr, "child restarted %d times within %d seconds; giving up\n",
+            opt.respawn_burst, opt.respawn_interval);
+    goto done;
+  }
+
+  /* Back off exponentially while the child keeps failing quickly */
+  if (delay == 0 || ran >= opt.respawn_interval * 1000LL)
+    delay = opt.respawn_delay_min;
+  else if ((delay *= 2) > opt.respawn_delay_max)
+    delay = opt.respawn_delay_max;
+
+  if (is_verbose())
+    fprintf(stderr, "child exited with status %d after %lld ms; respawning in %d ms\n",
+            retcode, ran, delay);
+
+  if (!backoff(delay, mask, oldmask))
+    goto done;
+
+  clock_gettime(CLOCK_MONOTONIC, oldest);
+  restarts++;
+  return true;
+
+done:
+  free(history);
+  history = NULL;
+  return false;
+}
+
+/* Apply any supervisor-specific affinity and scheduling once the child
+ * has been forked with the workload's, remembering the latter so that
+ * respawned children can be put back. */
+void enter_supervisor_state(void) {
+  if (workload.saved ||
+      !(opt.supervisor_affinity.size ||
+        set(OPT_SUPERVISOR_CPU_SCHED) ||
+        set(OPT_SUPERVISOR_IO_SCHED)))
+    return;
+
+  workload.affinity_size = CPU_ALLOC_SIZE(get_nprocs_conf());
+  workload.affinity = CPU_ALLOC(get_nprocs_conf());
+  if (workload.affinity == NULL ||
+      sched_getaffinity(0, workload.affinity_size, workload.affinity) == -1 ||
+      sched_get_attr(&workload.attr) == -1 ||
+      (workload.ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0)) == -1) {
+    perror("could not save workload scheduling state");
+    if (workload.affinity)
+      CPU_FREE(workload.affinity);
+    return;
+  }
+  workload.saved = true;
+
+  if (opt.supervisor_affinity.size &&
+      sched_setaffinity(0, opt.supervisor_affinity.size,
+                        opt.supervisor_affinity.mask) == -1)
+    perror("could not set supervisor CPU affinity");
+
+  if (set(OPT_SUPERVISOR_CPU_SCHED))
+    sched_apply(&opt.supervisor_sched_attr, "supervisor");
+
+  if (set(OPT_SUPERVISOR_IO_SCHED) &&
+      syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+              opt.supervisor_ionice_prio) == -1)
+    perror("could not set supervisor I/O scheduling class");
+
+  if (is_verbose())
+    fprintf(stderr, "supervisor scheduling state applied\n");
+}
+
+/* Restore the workload's scheduling state in a freshly forked child.
+ * A supervisor that has dropped its privileges may be unable to raise
+ * itself back, in which case the child must not run at all. */
+bool leave_supervisor_state(void) {
+  bool restored = true;
+
+  if (!workload.saved)
+    return true;
+
+  if (set(OPT_SUPERVISOR_IO_SCHED) &&
+      syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, workload.ioprio) == -1) {
+    perror("could not restore I/O scheduling class");
+    restored = false;
+  }
+  if (set(OPT_SUPERVISOR_CPU_SCHED) && sched_set_attr(&workload.attr) == -1) {
+    perror("could not restore scheduler policy");
+    restored = false;
+  }
+  if (opt.supervisor_affinity.size &&
+      sched_setaffinity(0, workload.affinity_size, workload.affinity) == -1) {
+    perror("could not restore CPU affinity");
+    restored = false;
+  }
+
+  CPU_FREE(workload.affinity);
+  workload.saved = false;
+  return restored;
+}
+
+/* Whether an unprivileged supervisor could put respawned children back
+ * to the workload's scheduling: it may not leave the idle policy, lower
+ * a real-time priority and raise it again, or return to real-time I/O */
+bool supervisor_state_reversible(void) {
+  struct sched_attributes workload_attr = { .size = sizeof workload_attr };
+  const struct sched_attributes *sup = &opt.supervisor_sched_attr;
+  int ioprio;
+
+  if (set(OPT_CPU_SCHED))
+    workload_attr = opt.sched_attr;
+  else if (sched_get_attr(&workload_attr) == -1)
+    return true;
+
+  if (set(OPT_SUPERVISOR_CPU_SCHED)) {
+    if (sup->sched_policy == SCHED_IDLE &&
+        workload_attr.sched_policy != SCHED_IDLE)
+      return false;
+    if ((workload_attr.sched_policy == SCHED_FIFO ||
+         workload_attr.sched_policy == SCHED_RR) &&
+        ((sup->sched_policy != SCHED_FIFO && sup->sched_policy != SCHED_RR) ||
+         sup->sched_priority < workload_attr.sched_priority))
+      return false;
+  }
+
+  if (set(OPT_SUPERVISOR_IO_SCHED)) {
+    ioprio = set(OPT_IO_SCHED) ? opt.ionice_prio :
+             syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    if (ioprio != -1 && IOPRIO_PRIO_CLASS(ioprio) == IOPRIO_CLASS_RT)
+      return false;
+  }
+
+  return true;
+}
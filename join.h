@@ -4,6 +4,15 @@
 #ifndef _JOIN_H
 #define _JOIN_H
 
-bool join(pid_t child, sigset_t *mask, sigset_t *oldmask, int *retcode);
+#include <stdint.h>
+#include <time.h>
+
+pid_t launch(uint64_t flags, int cgroup_fd, int *pidfd);
+bool join(pid_t child, int pidfd, sigset_t *mask, sigset_t *oldmask, int *retcode);
+bool respawn(int retcode, const struct timespec *started,
+             sigset_t *mask, sigset_t *oldmask);
+void enter_supervisor_state(void);
+bool leave_supervisor_state(void);
+bool supervisor_state_reversible(void);
 
 #endif
@@ -43,6 +43,18 @@ int private_mount(char *path) {
   return special_mount(path, "tmpfs", "private", "mode=0755");
 }
 
+int private_shm_mount(const char *size) {
+  char *options;
+  int rc;
+
+  if (asprintf(&options, "mode=1777%s%s",
+               size ? ",size=" : "", size ? size : "") == -1)
+    return -1;
+  rc = special_mount("/dev/shm", "tmpfs", "private shm", options);
+  free(options);
+  return rc;
+}
+
 int remount_ro(const char *path) {
   struct stat statbuf;
   int rc;
@@ -6,6 +6,7 @@
 
 extern int special_mount(char *path, char *fs, char *desc, char *options);
 extern int private_mount(char *path);
+extern int private_shm_mount(const char *size);
 extern int remount_ro(const char *path);
 extern int remount_sys_ro(void);
 
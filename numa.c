@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+/* xchpst: eXtended Change Process State
+ * A tool that is backwards compatible with chpst(8) from runit(8),
+ * offering additional options to harden process with namespace isolation
+ * and more. */
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+#include "xchpst.h"
+#include "options.h"
+#include "numa.h"
+
+static const char *node_dir = "/sys/devices/system/node";
+
+/* Missing in glibc */
+static long set_memory_policy(int mode, const unsigned long *nodemask,
+                              unsigned long maxnode) {
+  return syscall(SYS_set_mempolicy, mode, nodemask, maxnode);
+}
+
+static bool node_free_memory(int node, unsigned long long *kb) {
+  char path[64];
+  char line[128];
+  bool found = false;
+  int n;
+  FILE *f;
+
+  snprintf(path, sizeof path, "%s/node%d/meminfo", node_dir, node);
+  f = fopen(path, "re");
+  if (f == NULL)
+    return false;
+  while (!found && fgets(line, sizeof line, f))
+    found = sscanf(line, "Node %d MemFree: %llu kB", &n, kb) == 2;
+  fclose(f);
+  return found;
+}
+
+/* Choose the node with the most free memory */
+static int pick_node(void) {
+  unsigned long long best_kb = 0;
+  unsigned long long kb;
+  struct dirent *entry;
+  int best = -1;
+  int node;
+  DIR *dir;
+
+  dir = opendir(node_dir);
+  if (dir == NULL) {
+    fprintf(stderr, "could not read NUMA nodes, %s\n", strerror(errno));
+    return -1;
+  }
+  while ((entry = readdir(dir)))
+    if (sscanf(entry->d_name, "node%d", &node) == 1 &&
+        node_free_memory(node, &kb) && (best == -1 || kb > best_kb)) {
+      best = node;
+      best_kb = kb;
+    }
+  closedir(dir);
+
+  if (best == -1)
+    fprintf(stderr, "no NUMA node with memory found\n");
+  else if (is_verbose())
+    fprintf(stderr, "NUMA node %d has most free memory, %llu kB\n", best, best_kb);
+  return best;
+}
+
+/* Run on the CPUs of the node unless told otherwise */
+static void follow_node_cpus(int node) {
+  char path[64];
+  char list[1024];
+  size_t len;
+  FILE *f;
+
+  if (opt.cpu_affinity.size)
+    return;
+
+  snprintf(path, sizeof path, "%s/node%d/cpulist", node_dir, node);
+  f = fopen(path, "re");
+  if (f == NULL)
+    return;
+  len = fread(list, 1, sizeof list - 1, f);
+  fclose(f);
+  while (len && list[len - 1] == '\n')
+    len--;
+  list[len] = '\0';
+
+  /* Memory-only nodes have no CPUs of their own */
+  if (len == 0)
+    return;
+  parse_cpus(list, &opt.cpu_affinity);
+  if (is_verbose())
+    fprintf(stderr, "following NUMA node %d CPUs %s\n", node, list);
+}
+
+int numa_apply(void) {
+  int node;
+
+  if (opt.numa_auto) {
+    if ((node = pick_node()) == -1)
+      return -1;
+    opt.numa_nodes.size = CPU_ALLOC_SIZE(node + 1);
+    opt.numa_nodes.mask = CPU_ALLOC(node + 1);
+    if (opt.numa_nodes.mask == NULL) {
+      perror("CPU_ALLOC");
+      return -1;
+    }
+    CPU_ZERO_S(opt.numa_nodes.size, opt.numa_nodes.mask);
+    CPU_SET_S(node, opt.numa_nodes.size, opt.numa_nodes.mask);
+    follow_node_cpus(node);
+  }
+
+  /* A CPU set is a bitmap of unsigned longs, just like a node mask */
+  if (set_memory_policy(opt.numa_policy,
+                        (const unsigned long *) opt.numa_nodes.mask,
+                        opt.numa_nodes.size * 8 + 1) == -1) {
+    fprintf(stderr, "could not set NUMA memory policy, %s\n", strerror(errno));
+    return -1;
+  }
+  if (is_verbose())
+    fprintf(stderr, "set NUMA memory policy %d\n", opt.numa_policy);
+  return 0;
+}
@@ -0,0 +1,9 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _NUMA_H
+#define _NUMA_H
+
+extern int numa_apply(void);
+
+#endif
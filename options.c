@@ -6,19 +6,33 @@
 #include <getopt.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <linux/mempolicy.h>
+#include <linux/sched.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "options.h"
-
-struct options opt;
+#include "topology.h"
+
+struct options opt = {
+  .respawn_burst = 5,
+  .respawn_interval = 60,
+  .respawn_delay_min = 100,
+  .respawn_delay_max = 10000,
+  .reclaim_target = 75,
+  .ready_fd = -1,
+  .join_cgroup_fd = -1,
+  .join_ready_fd = -1,
+};
 
 const struct option_info options_info[] = {
   { C_R, OPT_SETUIDGID,   'u',  NULL,       required_argument, "set uid, gid and supplementary groups", "[:]USER[:GROUP]*", },
@@ -67,9 +81,11 @@ const struct option_info options_info[] = {
   { C_X, OPT_USER_NS,     '\0', "user-ns",  no_argument,       "create user namespace", NULL },
   { C_X, OPT_PID_NS,      '\0', "pid-ns",   no_argument,       "create pid namespace", NULL },
   { C_X, OPT_UTS_NS,      '\0', "uts-ns",   no_argument,       "create uts namespace", NULL },
+  { C_X, OPT_IPC_NS,      '\0', "ipc-ns",   no_argument,       "create ipc namespace", NULL },
   { C_X, OPT_NET_ADOPT,   '\0', "adopt-net",required_argument, "adopt net namespace", "NS-PATH" },
   { C_X, OPT_PRIVATE_RUN, '\0', "private-run",  no_argument,    "create private /run", NULL },
   { C_X, OPT_PRIVATE_TMP, '\0', "private-tmp",  no_argument,    "create private /tmp", NULL },
+  { C_X, OPT_PRIVATE_SHM, '\0', "private-shm",  optional_argument, "create private /dev/shm", "SIZE" },
   { C_X, OPT_PROTECT_HOME,'\0', "protect-home", no_argument,    "hide home directories", NULL },
   { C_X, OPT_RO_HOME,     '\0', "ro-home",      no_argument,    "make home directories read only", NULL },
   { C_X, OPT_RO_SYS,      '\0', "ro-sys",       no_argument,    "create read only system", NULL },
@@ -79,6 +95,16 @@ const struct option_info options_info[] = {
   { C_X, OPT_CAPS_KEEP,   '\0', "caps-keep",    required_argument, "keep (only) these capabilities", "CAP[,...]" },
   { C_X, OPT_CAPS_DROP,   '\0', "caps-drop",    required_argument, "drop these capabilities", "CAP[,...]" },
   { C_X, OPT_FORK_JOIN,   '\0', "fork-join",    no_argument,   "fork and wait for process", NULL },
+  { C_X, OPT_DETACH,      '\0', "detach",       no_argument,   "fork as sibling and exit", NULL },
+  { C_X, OPT_REAP,        '\0', "reap",         no_argument,   "reap orphaned descendants", NULL },
+  { C_X, OPT_SIGNAL_GROUP,'\0', "signal-group", no_argument,   "pass signals to child process group", NULL },
+  { C_X, OPT_RESPAWN,     '\0', "respawn",      optional_argument, "respawn child on failure", "BURST[/SECS]" },
+  { C_X, OPT_RESPAWN_DELAY,'\0',"respawn-delay",required_argument, "set respawn backoff", "MS[:MAX-MS]" },
+  { C_X, OPT_SUPERVISOR_CPUS,     '\0', "supervisor-cpus",         required_argument, "set supervisor CPU affinity", "AFFINITY" },
+  { C_X, OPT_SUPERVISOR_CPU_SCHED,'\0', "supervisor-cpu-scheduler",required_argument, "set supervisor CPU scheduler policy", "POLICY" },
+  { C_X, OPT_SUPERVISOR_IO_SCHED, '\0', "supervisor-io-scheduler", required_argument, "set supervisor I/O scheduling class", "CLASS[:PRIORITY]" },
+  { C_X, OPT_LEAN_JOIN,   '\0', "lean-join",    no_argument,   "join child from a minimal process", NULL },
+  { C_X, OPT_JOIN,        '\0', "join",         required_argument, "(internal) join inherited child", "PID:PIDFD[:CGROUPFD[:READYFD]]" },
   { C_X, OPT_NEW_ROOT,    '\0', "new-root",     no_argument,   "create a new root fs", NULL },
   { C_X, OPT_NO_NEW_PRIVS,'\0', "no-new-privs", no_argument,   "no new privileges", NULL },
   { C_X, OPT_CPUS,        '\0', "cpus",         required_argument, "set CPU affinity", "AFFINITY" },
@@ -91,8 +117,49 @@ const struct option_info options_info[] = {
   { C_X, OPT_CACHE_DIR,   '\0', "cache-dir", no_argument,      "create cache dir", NULL },
   { C_X, OPT_LOG_DIR,     '\0', "log-dir",   no_argument,      "create log dir", NULL },
   { C_X, OPT_LOGIN,       '\0', "login",     no_argument,      "simulate login environment", NULL },
+  { C_X, OPT_CPUS_SPREAD, '\0', "cpus-spread",no_argument,     "spread concurrent --cpus auto picks", NULL },
+  { C_X, OPT_NUMA_BIND,   '\0', "numa-bind", required_argument,"allocate memory only on NUMA nodes", "NODES" },
+  { C_X, OPT_NUMA_PREFERRED,'\0',"numa-preferred",required_argument,"prefer memory on NUMA nodes", "NODES" },
+  { C_X, OPT_NUMA_INTERLEAVE,'\0',"numa-interleave",required_argument,"interleave memory across NUMA nodes", "NODES" },
+  { C_X, OPT_NUMA,        '\0', "numa",      required_argument,"place on NUMA node with most free memory", "auto" },
+  { C_X, OPT_PROFILE,     '\0', "profile",   required_argument,"apply performance profile", "NAME" },
+  { C_X, OPT_TIMER_SLACK, '\0', "timer-slack",required_argument,"set timer slack", "NS" },
+  { C_X, OPT_CORE_SCHED,  '\0', "core-sched", required_argument, "share SMT cores only with trusted tasks", "new|group:NAME" },
+  { C_X, OPT_AUTOGROUP_NICE,'\0',"autogroup-nice",required_argument,"set session autogroup niceness", "NICE" },
   { C_X, OPT_OOM,         '\0', "oom",       required_argument,"set oom adjust value", "ADJ" },
   { C_X, OPT_HARDLIMIT,   '\0', "hardlimit", no_argument,      "set hard limits with soft limits", NULL },
+  { C_X, OPT_CGROUP,      '\0', "cgroup",    required_argument,"place in cgroup v2 directory", "DIR" },
+  { C_X, OPT_CGROUP_BASE, '\0', "cgroup-base", required_argument,"create relative cgroups under DIR", "DIR" },
+  { C_X, OPT_CGROUP_DELEGATE,'\0',"cgroup-delegate",no_argument,"delegate cgroup to user", NULL },
+  { C_X, OPT_CPU_MAX,     '\0', "cpu-max",   required_argument,"set cgroup CPU bandwidth limit", "QUOTA[/PERIOD]" },
+  { C_X, OPT_CPU_WEIGHT,  '\0', "cpu-weight",required_argument,"set cgroup CPU weight", "WEIGHT" },
+  { C_X, OPT_PIDS_MAX,    '\0', "pids-max",  required_argument,"set cgroup limit on tasks", "NUM" },
+  { C_X, OPT_MEMORY_LOW,  '\0', "memory-low", required_argument,"set cgroup memory protection", "BYTES" },
+  { C_X, OPT_MEMORY_HIGH, '\0', "memory-high",required_argument,"set cgroup memory throttling limit", "BYTES" },
+  { C_X, OPT_MEMORY_MAX,  '\0', "memory-max", required_argument,"set cgroup memory hard limit", "BYTES" },
+  { C_X, OPT_MEMORY_SWAP_MAX,'\0',"memory-swap-max",required_argument,"set cgroup swap limit", "BYTES" },
+  { C_X, OPT_IO_MAX,      '\0', "io-max",    required_argument,"set cgroup I/O limits for device", "DEVICE,LIMIT=N[,...]" },
+  { C_X, OPT_IO_WEIGHT,   '\0', "io-weight", required_argument,"set cgroup I/O weight", "[DEVICE,]WEIGHT" },
+  { C_X, OPT_IO_LATENCY,  '\0', "io-latency",required_argument,"set cgroup I/O latency target", "DEVICE,MICROSECONDS" },
+  { C_X, OPT_CPUSET_CPUS, '\0', "cpuset-cpus",required_argument,"confine cgroup to CPUs", "CPUS" },
+  { C_X, OPT_CPUSET_MEMS, '\0', "cpuset-mems",required_argument,"confine cgroup to memory nodes", "NODES" },
+  { C_X, OPT_CPUSET_PARTITION,'\0',"cpuset-partition",required_argument,"make cgroup a CPU partition", "root|isolated|member" },
+  { C_X, OPT_UCLAMP_MIN,  '\0', "uclamp-min",required_argument,"set minimum utilisation clamp", "PERCENT" },
+  { C_X, OPT_UCLAMP_MAX,  '\0', "uclamp-max",required_argument,"set maximum utilisation clamp", "PERCENT" },
+  { C_X, OPT_MEMORY_RECLAIM,'\0',"memory-reclaim",required_argument,"reclaim cgroup memory periodically", "SECS[:PERCENT]" },
+  { C_X, OPT_MEMORY_RECLAIM_RATE,'\0',"memory-reclaim-rate",required_argument,"limit memory reclaimed per period", "BYTES" },
+  { C_X, OPT_MEMORY_RECLAIM_IDLE,'\0',"memory-reclaim-idle",required_argument,"only reclaim below CPU usage", "PERCENT" },
+  { C_X, OPT_STARTUP_CPU_WEIGHT,'\0',"startup-cpu-weight",required_argument,"set cgroup CPU weight during startup", "WEIGHT" },
+  { C_X, OPT_STARTUP_IO_WEIGHT,'\0',"startup-io-weight",required_argument,"set cgroup I/O weight during startup", "WEIGHT" },
+  { C_X, OPT_STARTUP_BOOST,'\0',"startup-boost", required_argument,"end startup weights after time", "SECS" },
+  { C_X, OPT_READY_FD,    '\0', "ready-fd",  required_argument,"end startup weights on readiness", "FD" },
+  { C_X, OPT_PRESSURE,    '\0', "pressure",  required_argument,"act on pressure stall", "RESOURCE:KIND:MS[/WINDOW][:ACTION]" },
+  { C_X, OPT_WAIT_RESOURCES,'\0',"wait-resources",required_argument,"wait for free resources before launch", "COND[,...]" },
+  { C_X, OPT_WAIT_TIMEOUT,'\0', "wait-timeout",required_argument,"give up waiting for resources", "SECS" },
+  { C_X, OPT_SLOTS,       '\0', "slots",     required_argument,"take one of N lock slots", "FILE:N" },
+  { C_X, OPT_SLOTS_TRY,   '\0', "slots-try", no_argument,      "don't wait for a slot", NULL },
+  { C_X, OPT_SLOTS_FAIR,  '\0', "slots-fair",no_argument,      "take slots in order of arrival", NULL },
+  { C_X, OPT_SYSCTL,      '\0', "sysctl",    required_argument,"set namespaced sysctl", "KEY=VALUE" },
 };
 #define max_options ((ssize_t) ((sizeof options_info / sizeof *options_info)))
 
@@ -342,7 +409,8 @@ bool parse_cpu_range(const char *str, int range[3], int *max) {
   return true;
 }
 
-void parse_cpus(char *spec) {
+static void parse_list(char *spec, struct cpu_mask *affinity, bool selectors) {
+  char *expanded = NULL;
   char *rest = spec;
   char *tok;
   char *end = spec;
@@ -350,32 +418,82 @@ void parse_cpus(char *spec) {
   int cpu;
   int max = 0;
 
+  /* Resolve any topology selectors to CPU numbers first */
+  if (topology_selector(spec) && !selectors) {
+    fprintf(stderr, "topology selectors only apply to CPU lists: %s\n", spec);
+    opt.error = true;
+    return;
+  } else if (topology_selector(spec)) {
+    if ((expanded = topology_expand(spec)) == NULL) {
+      opt.error = true;
+      return;
+    }
+    rest = spec = end = expanded;
+  }
+
   while((tok = strsep(&rest, ","))) {
     if (!parse_cpu_range(tok, range, &max))
       goto fail;
     end = tok;
   }
-  opt.cpu_affinity.size = CPU_ALLOC_SIZE(max++);
-  opt.cpu_affinity.mask = CPU_ALLOC(max);
-  if (opt.cpu_affinity.mask == NULL) {
+  affinity->size = CPU_ALLOC_SIZE(++max);
+  affinity->mask = CPU_ALLOC(max);
+  if (affinity->mask == NULL) {
     perror("CPU_ALLOC");
     goto fail;
   }
-  CPU_ZERO_S(opt.cpu_affinity.size, opt.cpu_affinity.mask);
+  CPU_ZERO_S(affinity->size, affinity->mask);
 
   for (tok = spec; tok <= end; tok += strlen(tok) + 1) {
     parse_cpu_range(tok, range, NULL);
     for (cpu = range[0]; cpu <= range[1]; cpu += range[2])
-      CPU_SET_S(cpu, opt.cpu_affinity.size, opt.cpu_affinity.mask);
+      CPU_SET_S(cpu, affinity->size, affinity->mask);
   }
+  free(expanded);
   return;
 
 fail:
   opt.error = true;
   fprintf(stderr, "error in CPU list (at %s)\n", tok);
+  free(expanded);
 }
 
-void parse_ionice(char *spec) {
+void parse_cpus(char *spec, struct cpu_mask *affinity) {
+  parse_list(spec, affinity, true);
+}
+
+/* NUMA node lists share the format but not the CPU topology selectors */
+void parse_nodes(char *spec, struct cpu_mask *nodes) {
+  parse_list(spec, nodes, false);
+}
+
+/* Format a CPU mask as a list, as used by cpuset files */
+char *format_cpus(const struct cpu_mask *set) {
+  int max = set->size * 8;
+  char *list = NULL;
+  size_t len = 0;
+  FILE *out;
+  int first;
+  int cpu;
+
+  out = open_memstream(&list, &len);
+  if (out == NULL) {
+    perror("open_memstream");
+    return NULL;
+  }
+  for (cpu = 0; cpu < max; cpu++) {
+    if (!CPU_ISSET_S(cpu, set->size, set->mask))
+      continue;
+    for (first = cpu; cpu + 1 < max && CPU_ISSET_S(cpu + 1, set->size, set->mask); cpu++);
+    fprintf(out, "%s%d", ftell(out) ? "," : "", first);
+    if (cpu > first)
+      fprintf(out, "-%d", cpu);
+  }
+  fclose(out);
+  return list;
+}
+
+void parse_ionice(char *spec, int *prio) {
   const char *classes[] = {
     "rt", "best-effort", "idle", NULL
   };
@@ -396,18 +514,550 @@ void parse_ionice(char *spec) {
   if (*s)
     s++;
   data = strtol(s, NULL, 10);
-  opt.ionice_prio = IOPRIO_PRIO_VALUE(n, data);
+  *prio = IOPRIO_PRIO_VALUE(n, data);
+}
+
+bool parse_sysctl(char *arg) {
+  struct sysctl *sysctls;
+  char *value = strchr(arg, '=');
+
+  if (value == NULL || value == arg) {
+    fprintf(stderr, "sysctl setting must be KEY=VALUE: %s\n", arg);
+    return false;
+  }
+  *value++ = '\0';
+
+  sysctls = reallocarray(opt.sysctls, opt.num_sysctls + 1, sizeof *sysctls);
+  if (sysctls == NULL) {
+    perror("reallocarray");
+    return false;
+  }
+  opt.sysctls = sysctls;
+  opt.sysctls[opt.num_sysctls++] = (struct sysctl) { arg, value };
+  return true;
+}
+
+/* Parse a pair of positive integers, the second being optional */
+bool parse_pair(const char *arg, char sep, int *first, int *second) {
+  char *end;
+  long val;
+
+  val = strtol(arg, &end, 10);
+  if (end == arg || val <= 0 || val > INT_MAX)
+    return false;
+  *first = val;
+  if (*end == sep) {
+    arg = end + 1;
+    val = strtol(arg, &end, 10);
+    if (end == arg || val <= 0 || val > INT_MAX)
+      return false;
+    *second = val;
+  }
+  return *end == '\0';
+}
+
+/* Parse a whole decimal integer within a range, optionally returning it */
+static bool parse_int_range(const char *arg, long long min, long long max,
+                            long long *value) {
+  long long val;
+  char *end;
+
+  errno = 0;
+  val = strtoll(arg, &end, 10);
+  if (end == arg || *end != '\0' || errno != 0 || val < min || val > max)
+    return false;
+  if (value)
+    *value = val;
+  return true;
+}
+
+/* Check a cgroup interface value, which may be "max" if allowed */
+bool parse_cgroup_value(const char *arg, long long min, long long max,
+                        bool allow_max) {
+  if (allow_max && !strcmp(arg, "max"))
+    return true;
+  return parse_int_range(arg, min, max, NULL);
+}
+
+/* Check a memory size as accepted by the memory controller, that is,
+ * "max" or bytes with an optional K, M, G or T suffix, optionally
+ * returning the number of bytes */
+bool parse_memory_size(const char *arg, unsigned long long *bytes) {
+  unsigned long long val;
+  const char *suffix;
+  char *end;
+  int shift = 0;
+
+  if (!strcmp(arg, "max")) {
+    val = ULLONG_MAX;
+    goto done;
+  }
+  if (!isdigit((unsigned char) *arg))
+    return false;
+  errno = 0;
+  val = strtoull(arg, &end, 10);
+  if (errno)
+    return false;
+  if (*end && (suffix = strchr("KMGT", toupper(*end)))) {
+    shift = 10 * (suffix - "KMGT" + 1);
+    end++;
+  }
+  if (*end != '\0' || val > (ULLONG_MAX >> shift))
+    return false;
+  val <<= shift;
+
+done:
+  if (bytes)
+    *bytes = val;
+  return true;
+}
+
+static void check_memory_size(const char *arg) {
+  if (!parse_memory_size(arg, NULL)) {
+    fprintf(stderr, "invalid memory size: %s\n", arg);
+    opt.error = true;
+  }
+}
+
+/* Parse an io.max limit setting, allowing a size suffix for bandwidth */
+static bool parse_io_limit(const char *arg, char **setting) {
+  static const char *keys[] = { "rbps", "wbps", "riops", "wiops", NULL };
+  const char **key;
+  const char *value = strchr(arg, '=');
+  unsigned long long val;
+  char *end;
+  char *next;
+  int shift = 0;
+
+  if (value == NULL)
+    return false;
+  for (key = keys; *key && strncmp(arg, *key, value - arg); key++);
+  if (*key == NULL || strlen(*key) != (size_t) (value - arg))
+    return false;
+  value++;
+
+  if (!strcmp(value, "max")) {
+    val = 0;
+  } else {
+    if (!isdigit((unsigned char) *value))
+      return false;
+    errno = 0;
+    val = strtoull(value, &end, 10);
+    if (errno || val == 0)
+      return false;
+    if (*end && (*key)[1] == 'b' && (next = strchr("KMGT", toupper(*end)))) {
+      shift = 10 * (next - "KMGT" + 1);
+      end++;
+    }
+    if (*end != '\0' || val > (ULLONG_MAX >> shift))
+      return false;
+    val <<= shift;
+  }
+
+  next = *setting;
+  if ((val ?
+       asprintf(setting, "%s%s%s=%llu", next ? next : "", next ? " " : "", *key, val) :
+       asprintf(setting, "%s%s%s=max", next ? next : "", next ? " " : "", *key)) == -1) {
+    *setting = next;
+    return false;
+  }
+  free(next);
+  return true;
+}
+
+/* Parse --io-max DEVICE,LIMIT=N[,...], --io-weight [DEVICE,]WEIGHT or
+ * --io-latency DEVICE,MICROSECONDS into a line for the cgroup file */
+bool parse_io_control(enum opt option, char *arg) {
+  struct io_control *controls;
+  struct io_control control = {};
+  char *value = strrchr(arg, ',');
+  char *item;
+  char *save;
+
+  if (option == OPT_IO_MAX)
+    value = strchr(arg, ',');
+  if (value) {
+    *value++ = '\0';
+    control.device = arg;
+  } else if (option == OPT_IO_WEIGHT) {
+    value = arg;
+  } else {
+    fprintf(stderr, "device required for I/O control: %s\n", arg);
+    return false;
+  }
+
+  switch (option) {
+  case OPT_IO_MAX:
+    control.file = "io.max";
+    for (item = strtok_r(value, ",", &save); item; item = strtok_r(NULL, ",", &save))
+      if (!parse_io_limit(item, &control.setting))
+        goto invalid;
+    if (control.setting == NULL)
+      goto invalid;
+    break;
+  case OPT_IO_WEIGHT:
+    control.file = "io.weight";
+    if (!parse_cgroup_value(value, 1, 10000, false) ||
+        (control.setting = strdup(value)) == NULL)
+      goto invalid;
+    break;
+  case OPT_IO_LATENCY:
+    control.file = "io.latency";
+    if (!parse_cgroup_value(value, 1, LLONG_MAX, false) ||
+        asprintf(&control.setting, "target=%s", value) == -1)
+      goto invalid;
+    break;
+  default:
+    return false;
+  }
+
+  controls = reallocarray(opt.io_controls, opt.num_io_controls + 1, sizeof *controls);
+  if (controls == NULL) {
+    perror("reallocarray");
+    free(control.setting);
+    return false;
+  }
+  opt.io_controls = controls;
+  opt.io_controls[opt.num_io_controls++] = control;
+  return true;
+
+invalid:
+  fprintf(stderr, "invalid setting for %s: %s\n", control.file, value);
+  free(control.setting);
+  return false;
+}
+
+/* Convert QUOTA[/PERIOD] into the format of cpu.max, where QUOTA is in
+ * microseconds, "max" or a percentage of one CPU per period */
+char *parse_cpu_max(const char *arg) {
+  long long quota = -1;
+  long long period = 100000;
+  bool percent = false;
+  char *result;
+  char *end;
+
+  if (!strncmp(arg, "max", 3)) {
+    end = (char *) arg + 3;
+  } else {
+    quota = strtoll(arg, &end, 10);
+    if (end == arg || quota <= 0)
+      goto invalid;
+    if (*end == '%') {
+      percent = true;
+      end++;
+    }
+  }
+  if (*end == '/') {
+    const char *per = end + 1;
+    period = strtoll(per, &end, 10);
+    if (end == per || period < 1000 || period > 1000000)
+      goto invalid;
+  }
+  if (*end != '\0')
+    goto invalid;
+  if (percent)
+    quota = quota * period / 100;
+  if (quota != -1 && quota < 1000)
+    goto invalid;
+
+  if ((quota == -1 ?
+       asprintf(&result, "max %lld", period) :
+       asprintf(&result, "%lld %lld", quota, period)) == -1) {
+    perror("asprintf");
+    return NULL;
+  }
+  return result;
+
+invalid:
+  fprintf(stderr, "invalid CPU bandwidth limit: %s\n", arg);
+  return NULL;
 }
 
-int sched_policy_from_name(const char *name) {
-  if (!strcmp(name, "batch"))
-    return SCHED_BATCH;
-  else if (!strcmp(name, "idle"))
-    return SCHED_IDLE;
-  else if (strcmp(name, "other"))
-    fprintf(stderr, "ignoring unknown scheduler policy: %s\n", name);
+static int signal_from_name(const char *name) {
+  const char *abbrev;
+  char *end;
+  int sig;
+
+  if (!strncmp(name, "SIG", 3))
+    name += 3;
+  sig = strtol(name, &end, 10);
+  if (end != name && *end == '\0')
+    return sig > 0 && sig < NSIG ? sig : -1;
+  for (sig = 1; sig < NSIG; sig++)
+    if ((abbrev = sigabbrev_np(sig)) && !strcmp(name, abbrev))
+      return sig;
+  return -1;
+}
+
+/* Parse RESOURCE:KIND:STALL-MS[/WINDOW-MS][:ACTION], where RESOURCE may
+ * be prefixed with "system/" to watch the whole system rather than the
+ * cgroup and ACTION is log, signal=SIG or throttle=QUOTA[/PERIOD] */
+bool parse_pressure(char *arg) {
+  static const char *resources[] = { "cpu", "memory", "io", NULL };
+  struct pressure_watch watch = { .window_ms = 2000 };
+  struct pressure_watch *watches;
+  const char **resource;
+  const char *spec = strdupa(arg);
+  char *fields[4] = {};
+  char *rest = arg;
+  char *action;
+  int n;
+
+  if (opt.num_pressure_watches == MAX_PRESSURE_WATCHES) {
+    fprintf(stderr, "too many pressure watches\n");
+    return false;
+  }
+
+  for (n = 0; n < 4 && (fields[n] = strsep(&rest, ":")); n++);
+  if (n < 3 || rest)
+    goto invalid;
 
-  return SCHED_OTHER;
+  if (!strncmp(fields[0], "system/", 7)) {
+    watch.system = true;
+    fields[0] += 7;
+  }
+  for (resource = resources; *resource && strcmp(*resource, fields[0]); resource++);
+  if (*resource == NULL)
+    goto invalid;
+  watch.resource = *resource;
+
+  if (!strcmp(fields[1], "full"))
+    watch.full = true;
+  else if (strcmp(fields[1], "some"))
+    goto invalid;
+
+  if (!parse_pair(fields[2], '/', &watch.stall_ms, &watch.window_ms) ||
+      watch.window_ms < 500 || watch.window_ms > 10000 ||
+      watch.stall_ms > watch.window_ms)
+    goto invalid;
+
+  action = fields[3];
+  if (action == NULL || !strcmp(action, "log")) {
+    watch.action = PRESSURE_LOG;
+  } else if (!strncmp(action, "signal=", 7)) {
+    watch.action = PRESSURE_SIGNAL;
+    if ((watch.signal = signal_from_name(action + 7)) == -1)
+      goto invalid;
+  } else if (!strncmp(action, "throttle=", 9)) {
+    watch.action = PRESSURE_THROTTLE;
+    if ((watch.throttle = parse_cpu_max(action + 9)) == NULL)
+      goto invalid;
+  } else {
+    goto invalid;
+  }
+
+  watches = reallocarray(opt.pressure_watches, opt.num_pressure_watches + 1,
+                         sizeof *watches);
+  if (watches == NULL) {
+    perror("reallocarray");
+    free(watch.throttle);
+    return false;
+  }
+  opt.pressure_watches = watches;
+  opt.pressure_watches[opt.num_pressure_watches++] = watch;
+  return true;
+
+invalid:
+  fprintf(stderr, "invalid pressure watch: %s\n", spec);
+  return false;
+}
+
+/* Parse a comma-separated list of conditions to be met before launch:
+ * available=BYTES for MemAvailable, load=N for the one minute load
+ * average and RESOURCE[:KIND]=PERCENT for the 10s pressure average */
+bool parse_wait_resources(char *arg) {
+  static const char *resources[] = { "cpu", "memory", "io", NULL };
+  struct wait_condition cond;
+  unsigned long long bytes;
+  const char **resource;
+  const char *spec = strdupa(arg);
+  char *rest = arg;
+  char *key;
+  char *value;
+  char *kind;
+  char *end;
+
+  while ((value = strsep(&rest, ","))) {
+    key = strsep(&value, "=");
+    if (value == NULL || *value == '\0')
+      goto invalid;
+    cond = (struct wait_condition) {};
+
+    if (!strcmp(key, "available")) {
+      cond.kind = WAIT_MEMORY;
+      if (!parse_memory_size(value, &bytes) || bytes == ULLONG_MAX)
+        goto invalid;
+      cond.limit = bytes;
+    } else if (!strcmp(key, "load")) {
+      cond.kind = WAIT_LOAD;
+      cond.limit = strtod(value, &end);
+      if (*end != '\0' || !(cond.limit >= 0))
+        goto invalid;
+    } else {
+      cond.kind = WAIT_PRESSURE;
+      kind = key;
+      key = strsep(&kind, ":");
+      for (resource = resources; *resource && strcmp(*resource, key); resource++);
+      if (*resource == NULL)
+        goto invalid;
+      cond.resource = *resource;
+      if (kind && !strcmp(kind, "full"))
+        cond.full = true;
+      else if (kind && strcmp(kind, "some"))
+        goto invalid;
+      cond.limit = strtod(value, &end);
+      if (*end != '\0' || !(cond.limit >= 0 && cond.limit < 100))
+        goto invalid;
+    }
+
+    if (opt.num_wait_conditions == MAX_WAIT_CONDITIONS) {
+      fprintf(stderr, "too many resource conditions\n");
+      return false;
+    }
+    opt.wait_conditions[opt.num_wait_conditions++] = cond;
+  }
+  return true;
+
+invalid:
+  fprintf(stderr, "invalid resource condition: %s\n", spec);
+  return false;
+}
+
+/* Full CPU capacity in utilisation clamps, per the kernel */
+#define SCHED_CAPACITY_SCALE 1024
+
+/* Parse a utilisation clamp as a percentage of CPU capacity or "max",
+ * giving both the cgroup setting and the per-task value out of 1024 */
+static bool parse_uclamp(const char *arg, char **setting, unsigned int *util) {
+  double percent = 100;
+  char *end;
+
+  if (strcmp(arg, "max")) {
+    percent = strtod(arg, &end);
+    if (end == arg || *end != '\0' || !(percent >= 0 && percent <= 100))
+      return false;
+  }
+  free(*setting);
+  if ((percent == 100 ?
+       asprintf(setting, "max") :
+       asprintf(setting, "%.2f", percent)) == -1) {
+    *setting = NULL;
+    return false;
+  }
+  *util = percent * SCHED_CAPACITY_SCALE / 100 + 0.5;
+  return true;
+}
+
+/* Parse a duration in nanoseconds, or with a us, ms or s suffix */
+static bool parse_duration_ns(const char *arg, uint64_t *ns) {
+  static const struct {
+    const char *suffix;
+    uint64_t scale;
+  } units[] = {
+    { "", 1 }, { "ns", 1 }, { "us", 1000 }, { "ms", 1000000 }, { "s", 1000000000 },
+  };
+  unsigned long long val;
+  char *end;
+  size_t i;
+
+  if (!isdigit((unsigned char) *arg))
+    return false;
+  errno = 0;
+  val = strtoull(arg, &end, 10);
+  if (errno)
+    return false;
+  for (i = 0; i < sizeof units / sizeof *units; i++)
+    if (!strcmp(end, units[i].suffix))
+      break;
+  if (i == sizeof units / sizeof *units || val > UINT64_MAX / units[i].scale)
+    return false;
+  *ns = val * units[i].scale;
+  return true;
+}
+
+/* Parse POLICY[:PARAMS][,reset-on-fork], where the real-time policies
+ * fifo and rr take a priority and deadline takes RUNTIME/DEADLINE[/PERIOD] */
+bool parse_sched(char *arg, struct sched_attributes *attr) {
+  static const struct {
+    const char *name;
+    int policy;
+  } policies[] = {
+    { "other", SCHED_OTHER },
+    { "batch", SCHED_BATCH },
+    { "idle", SCHED_IDLE },
+    { "fifo", SCHED_FIFO },
+    { "rr", SCHED_RR },
+    { "deadline", SCHED_DEADLINE },
+  };
+  const char *spec = strdupa(arg);
+  char *flags = arg;
+  char *params;
+  char *name;
+  char *time;
+  long long value;
+  size_t i;
+
+  *attr = (struct sched_attributes) { .size = sizeof *attr };
+  params = strsep(&flags, ",");
+  name = strsep(&params, ":");
+  for (i = 0; i < sizeof policies / sizeof *policies; i++)
+    if (!strcmp(name, policies[i].name))
+      break;
+  if (i == sizeof policies / sizeof *policies) {
+    fprintf(stderr, "unknown scheduler policy: %s\n", name);
+    return false;
+  }
+  attr->sched_policy = policies[i].policy;
+
+  switch (attr->sched_policy) {
+  case SCHED_FIFO:
+  case SCHED_RR:
+    if (params == NULL ||
+        !parse_int_range(params, sched_get_priority_min(attr->sched_policy),
+                         sched_get_priority_max(attr->sched_policy), &value))
+      goto invalid;
+    attr->sched_priority = value;
+    break;
+  case SCHED_DEADLINE:
+    if (params == NULL ||
+        (time = strsep(&params, "/")) == NULL ||
+        !parse_duration_ns(time, &attr->sched_runtime))
+      goto invalid;
+    if ((time = strsep(&params, "/")) == NULL ||
+        !parse_duration_ns(time, &attr->sched_deadline))
+      goto invalid;
+    if ((time = strsep(&params, "/")) &&
+        !parse_duration_ns(time, &attr->sched_period))
+      goto invalid;
+    if (params)
+      goto invalid;
+    if (attr->sched_period == 0)
+      attr->sched_period = attr->sched_deadline;
+    if (attr->sched_runtime < 1024 ||
+        attr->sched_runtime > attr->sched_deadline ||
+        attr->sched_deadline > attr->sched_period)
+      goto invalid;
+    /* The kernel never grants a whole CPU's bandwidth */
+    if (attr->sched_runtime == attr->sched_period) {
+      fprintf(stderr, "deadline runtime must be shorter than its period: %s\n",
+              spec);
+      return false;
+    }
+    break;
+  default:
+    if (params)
+      goto invalid;
+  }
+
+  if (flags && !strcmp(flags, "reset-on-fork"))
+    attr->sched_flags |= SCHED_FLAG_RESET_ON_FORK;
+  else if (flags)
+    goto invalid;
+  return true;
+
+invalid:
+  fprintf(stderr, "invalid scheduler policy: %s\n", spec);
+  return false;
 }
 
 const struct option_info *find_option(int by_code,
@@ -442,18 +1092,15 @@ const struct option_info *find_option(int by_code,
     return optdef;
 }
 
-static void read_options_file(const char *path) {
-  struct options_file *opt_file;
-  struct stat statbuf;
-  int fd;
-  int rc;
-  off_t offset;
+/* Handle the options in a loaded options file, leaving alone any that
+ * have already been given if only_unset, as for profiles */
+static void parse_options_file(struct options_file *opt_file, off_t size,
+                               bool only_unset) {
   char *ptr;
   char *option_name = NULL;
   char *option_name_end = NULL;
   char *option_value = NULL;
   char *option_value_end = NULL;
-  ssize_t len;
   const struct option_info *optdef;
   enum compat_level compat = opt.app->compat_level;
   enum {
@@ -467,43 +1114,8 @@ static void read_options_file(const char *path) {
     S_POSSIBLY_TRAILING_WSP,
   } state = S_LEADING_WSP;
 
-  fd = open(path, O_RDONLY);
-  if (fd == -1) {
-    fprintf(stderr, "error opening options file %s: %s\n", path, strerror(errno));
-    goto fail;
-  }
-
-  rc = fstat(fd, &statbuf);
-  if (rc == -1) {
-    close(fd);
-    goto fail;
-  }
-
-  /* We allocate the space for the file permanently, just as the argv array
-     remains allocated. Option processing modifies argument values.
-     Add one for NUL-terminating last element if not a newline. */
-  opt_file = malloc(sizeof *opt_file + statbuf.st_size + 1);
-  if (opt_file == NULL) {
-    close(fd);
-    goto fail;
-  }
-
-  opt_file->next = opt.opt_files;
-  opt.opt_files = opt_file;
-
-  offset = 0;
-  do {
-    len = read(fd, opt_file->content + offset, statbuf.st_size - offset);
-    if (len == -1) {
-      close(fd);
-      goto fail;
-    }
-    offset += len;
-  } while (offset < statbuf.st_size);
-  close(fd);
-
   ptr = opt_file->content;
-  for (ptr = opt_file->content; ptr - opt_file->content < statbuf.st_size; ptr++) {
+  for (ptr = opt_file->content; ptr - opt_file->content < size; ptr++) {
     char c = *ptr;
 
     /* Whether a key and value are now completely specified */
@@ -558,7 +1170,7 @@ static void read_options_file(const char *path) {
     }
 
     if (action /* EOL */ ||
-        (ptr + 1 == opt_file->content + statbuf.st_size /* EOF */ &&
+        (ptr + 1 == opt_file->content + size /* EOF */ &&
          state >= S_KEY /* An actionable state */)) {
       if (!action) {
         /* If EOF then there is no EOL character to overwrite */
@@ -590,6 +1202,11 @@ static void read_options_file(const char *path) {
       continue;
     }
 
+    if (only_unset && set(optdef->option)) {
+      option_value = NULL;
+      continue;
+    }
+
     if (is_verbose())
       fprintf(stderr, "handling file option '%s' with value '%s'\n", option_name, option_value);
 
@@ -604,6 +1221,53 @@ static void read_options_file(const char *path) {
     option_value = NULL;
   }
 
+}
+
+static void read_options_file(const char *path, bool only_unset) {
+  struct options_file *opt_file;
+  struct stat statbuf;
+  int fd;
+  int rc;
+  off_t offset;
+  ssize_t len;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "error opening options file %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  rc = fstat(fd, &statbuf);
+  if (rc == -1) {
+    close(fd);
+    goto fail;
+  }
+
+  /* We allocate the space for the file permanently, just as the argv array
+     remains allocated. Option processing modifies argument values.
+     Add one for NUL-terminating last element if not a newline. */
+  opt_file = malloc(sizeof *opt_file + statbuf.st_size + 1);
+  if (opt_file == NULL) {
+    close(fd);
+    goto fail;
+  }
+
+  opt_file->next = opt.opt_files;
+  opt.opt_files = opt_file;
+
+  offset = 0;
+  do {
+    len = read(fd, opt_file->content + offset, statbuf.st_size - offset);
+    if (len == -1) {
+      close(fd);
+      goto fail;
+    }
+    offset += len;
+  } while (offset < statbuf.st_size);
+  close(fd);
+
+  parse_options_file(opt_file, statbuf.st_size, only_unset);
+
   if (errno != 0) {
     fprintf(stderr, "error reading options file %s: %s\n", path, strerror(errno));
     goto fail;
@@ -614,11 +1278,122 @@ fail:
    opt.error = true;
 }
 
+static const char *profile_dir = "/etc/" NAME_STR "/profiles";
+
+/* Built-in profiles, in options file format */
+static const struct {
+  const char *name;
+  const char *options;
+} profiles[] = {
+  { "latency",
+    "timer-slack 1\n"
+    "cpu-scheduler other\n"
+    "io-scheduler best-effort:0\n"
+    "autogroup-nice -5\n"
+    "oom -500\n" },
+  { "throughput",
+    "timer-slack 50000\n"
+    "cpu-scheduler batch\n"
+    "io-scheduler best-effort:4\n"
+    "autogroup-nice 0\n"
+    "oom 0\n" },
+  { "background",
+    "timer-slack 10000000\n"
+    "cpu-scheduler idle\n"
+    "io-scheduler idle\n"
+    "autogroup-nice 19\n"
+    "oom 500\n" },
+};
+#define max_profiles ((ssize_t) (sizeof profiles / sizeof *profiles))
+
+/* Apply a profile for options not given explicitly, either built in or
+ * from an options file in the site profile directory or at a path */
+static void apply_profile(const char *name) {
+  struct options_file *opt_file;
+  char *path;
+  size_t size;
+  int i;
+
+  for (i = 0; i < max_profiles && strcmp(name, profiles[i].name); i++);
+  if (i == max_profiles) {
+    if (strchr(name, '/')) {
+      read_options_file(name, true);
+    } else if (asprintf(&path, "%s/%s", profile_dir, name) != -1) {
+      read_options_file(path, true);
+      free(path);
+    } else {
+      perror("asprintf");
+      opt.error = true;
+    }
+    return;
+  }
+
+  size = strlen(profiles[i].options);
+  opt_file = malloc(sizeof *opt_file + size + 1);
+  if (opt_file == NULL) {
+    perror("malloc");
+    opt.error = true;
+    return;
+  }
+  memcpy(opt_file->content, profiles[i].options, size + 1);
+  opt_file->next = opt.opt_files;
+  opt.opt_files = opt_file;
+
+  /* Every built-in profile sets the autogroup, which only applies to a
+   * session of our own, so only warn if it was asked for explicitly */
+  opt.autogroup_quiet = !set(OPT_AUTOGROUP_NICE);
+  parse_options_file(opt_file, size, true);
+}
+
+/* Options used by the supervisor after the child has been launched */
+static bool is_supervisor_option(enum opt option) {
+  switch (option) {
+  case OPT_CPU_MAX:
+  case OPT_CPU_WEIGHT:
+  case OPT_IO_WEIGHT:
+  case OPT_MEMORY_RECLAIM:
+  case OPT_MEMORY_RECLAIM_RATE:
+  case OPT_MEMORY_RECLAIM_IDLE:
+  case OPT_STARTUP_CPU_WEIGHT:
+  case OPT_STARTUP_IO_WEIGHT:
+  case OPT_STARTUP_BOOST:
+  case OPT_PRESSURE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Keep the unparsed form of an option for the lean join helper */
+static void keep_supervisor_arg(const struct option_info *optdef,
+                                const char *optarg) {
+  char **args;
+  char *arg;
+
+  if (asprintf(&arg, "--%s=%s", optdef->long_name, optarg) == -1) {
+    perror("asprintf");
+    return;
+  }
+  args = reallocarray(opt.supervisor_args, opt.num_supervisor_args + 1,
+                      sizeof *args);
+  if (args == NULL) {
+    perror("reallocarray");
+    free(arg);
+    return;
+  }
+  opt.supervisor_args = args;
+  opt.supervisor_args[opt.num_supervisor_args++] = arg;
+}
+
 static void handle_option(enum compat_level *compat,
                           const struct option_info *optdef,
                           char *optarg) {
+  long long value = 0;
   char *end;
 
+  if (optarg && is_supervisor_option(optdef->option))
+    keep_supervisor_arg(optdef, optarg);
+
   switch (optdef->option) {
   case OPT_LEGACY:
     *compat = COMPAT_CHPST;
@@ -630,7 +1405,7 @@ static void handle_option(enum compat_level *compat,
     opt.help = true;
     break;
   case OPT_FILE:
-    read_options_file(optarg);
+    read_options_file(optarg, false);
     break;
   case OPT_EXIT:
     opt.exit = true;
@@ -688,6 +1463,12 @@ static void handle_option(enum compat_level *compat,
   case OPT_UTS_NS:
     opt.new_ns |= CLONE_NEWUTS;
     break;
+  case OPT_IPC_NS:
+    opt.new_ns |= CLONE_NEWIPC;
+    break;
+  case OPT_PRIVATE_SHM:
+    opt.shm_size = optarg;
+    break;
   case OPT_NET_ADOPT:
     opt.net_adopt = optarg;
     break;
@@ -699,6 +1480,11 @@ static void handle_option(enum compat_level *compat,
   case OPT_RO_ETC:
   case OPT_PGRPHACK:
   case OPT_FORK_JOIN:
+  case OPT_DETACH:
+  case OPT_REAP:
+  case OPT_SIGNAL_GROUP:
+  case OPT_LEAN_JOIN:
+  case OPT_CGROUP_DELEGATE:
   case OPT_NEW_ROOT:
   case OPT_NO_NEW_PRIVS:
   case OPT_RUN_DIR:
@@ -730,18 +1516,109 @@ static void handle_option(enum compat_level *compat,
     opt.caps_op = CAP_OP_DROP;
     break;
   case OPT_CPU_SCHED:
-    opt.sched_policy = sched_policy_from_name(optarg);
+    if (!parse_sched(optarg, &opt.sched_attr))
+      opt.error = true;
     break;
   case OPT_CPUS:
-    parse_cpus(optarg);
+    if (!strncmp(optarg, "auto:", 5) ||
+        !strncmp(optarg, "exclusive:", 10)) {
+      char *pool = strchr(optarg, ':') + 1;
+      char *count = strsep(&pool, "@");
+
+      if (!parse_int_range(count, 1, CPU_SETSIZE, &value)) {
+        fprintf(stderr, "invalid number of %s: %s\n",
+                *optarg == 'a' ? "CPUs" : "cores", count);
+        opt.error = true;
+      }
+      opt.cpus_auto = *optarg == 'a' ? value : 0;
+      opt.cpus_exclusive = *optarg == 'e' ? value : 0;
+      if (pool)
+        parse_cpus(pool, &opt.cpus_pool);
+    } else {
+      parse_cpus(optarg, &opt.cpu_affinity);
+    }
+    break;
+  case OPT_CPUS_SPREAD:
+    opt.cpus_spread = true;
+    break;
+  case OPT_SUPERVISOR_CPU_SCHED:
+    if (!parse_sched(optarg, &opt.supervisor_sched_attr)) {
+      opt.error = true;
+    } else if (opt.supervisor_sched_attr.sched_policy == SCHED_DEADLINE) {
+      fprintf(stderr, "supervisor cannot use deadline scheduling\n");
+      opt.error = true;
+    }
+    break;
+  case OPT_SUPERVISOR_CPUS:
+    parse_cpus(optarg, &opt.supervisor_affinity);
+    break;
+  case OPT_SUPERVISOR_IO_SCHED:
+    parse_ionice(optarg, &opt.supervisor_ionice_prio);
     break;
   case OPT_IO_SCHED:
-    parse_ionice(optarg);
+    parse_ionice(optarg, &opt.ionice_prio);
     break;
   case OPT_UMASK:
     if (sscanf(optarg, "%o", &opt.umask) != 1)
       opt.error = true;
     break;
+  case OPT_NUMA_BIND:
+  case OPT_NUMA_PREFERRED:
+  case OPT_NUMA_INTERLEAVE:
+  case OPT_NUMA:
+    if (opt.numa_policy) {
+      fprintf(stderr, "only one NUMA memory policy may be given\n");
+      opt.error = true;
+      break;
+    }
+    if (optdef->option == OPT_NUMA) {
+      if (strcmp(optarg, "auto")) {
+        fprintf(stderr, "unknown NUMA placement: %s\n", optarg);
+        opt.error = true;
+      }
+      opt.numa_auto = true;
+      opt.numa_policy = MPOL_PREFERRED;
+      break;
+    }
+    parse_nodes(optarg, &opt.numa_nodes);
+    opt.numa_policy = optdef->option == OPT_NUMA_BIND ? MPOL_BIND :
+                      optdef->option == OPT_NUMA_INTERLEAVE ? MPOL_INTERLEAVE :
+                      CPU_COUNT_S(opt.numa_nodes.size, opt.numa_nodes.mask) > 1 ?
+                      MPOL_PREFERRED_MANY : MPOL_PREFERRED;
+    break;
+  case OPT_PROFILE:
+    opt.profile = optarg;
+    break;
+  case OPT_TIMER_SLACK:
+    if (!parse_int_range(optarg, 1, LONG_MAX, &value)) {
+      fprintf(stderr, "invalid timer slack: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.timer_slack = value;
+    break;
+  case OPT_AUTOGROUP_NICE:
+    if (!parse_int_range(optarg, -20, 19, &value)) {
+      fprintf(stderr, "autogroup niceness must be -20 to 19: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.autogroup_nice = value;
+    break;
+  case OPT_CORE_SCHED:
+    free(opt.core_sched_group);
+    opt.core_sched_group = NULL;
+    if (!strncmp(optarg, "group:", 6)) {
+      if (optarg[6] == '\0' || strchr(optarg + 6, '/') ||
+          optarg[6] == '.') {
+        fprintf(stderr, "invalid core scheduling group: %s\n", optarg + 6);
+        opt.error = true;
+      } else {
+        opt.core_sched_group = strdup(optarg + 6);
+      }
+    } else if (strcmp(optarg, "new")) {
+      fprintf(stderr, "unknown core scheduling mode: %s\n", optarg);
+      opt.error = true;
+    }
+    break;
   case OPT_OOM:
     opt.oom_adjust = strtol(optarg, &end, 10);
     if (*optarg == '\0' || *end != '\0')
@@ -750,6 +1627,203 @@ static void handle_option(enum compat_level *compat,
   case OPT_APP:
     opt.app_name = optarg;
     break;
+  case OPT_CGROUP:
+    opt.cgroup = optarg;
+    break;
+  case OPT_CGROUP_BASE:
+    opt.cgroup_base = optarg;
+    break;
+  case OPT_CPU_MAX:
+    free(opt.cpu_max);
+    if ((opt.cpu_max = parse_cpu_max(optarg)) == NULL)
+      opt.error = true;
+    break;
+  case OPT_CPU_WEIGHT:
+    if (!parse_cgroup_value(optarg, 1, 10000, false)) {
+      fprintf(stderr, "CPU weight must be 1-10000: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.cpu_weight = optarg;
+    break;
+  case OPT_PIDS_MAX:
+    if (!parse_cgroup_value(optarg, 0, LLONG_MAX, true)) {
+      fprintf(stderr, "invalid pids limit: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.pids_max = optarg;
+    break;
+  case OPT_MEMORY_LOW:
+    check_memory_size(optarg);
+    opt.memory_low = optarg;
+    break;
+  case OPT_MEMORY_HIGH:
+    check_memory_size(optarg);
+    opt.memory_high = optarg;
+    break;
+  case OPT_MEMORY_MAX:
+    check_memory_size(optarg);
+    opt.memory_max = optarg;
+    break;
+  case OPT_MEMORY_SWAP_MAX:
+    check_memory_size(optarg);
+    opt.memory_swap_max = optarg;
+    break;
+  case OPT_RESPAWN:
+    if (optarg &&
+        !parse_pair(optarg, '/', &opt.respawn_burst, &opt.respawn_interval)) {
+      fprintf(stderr, "invalid respawn limit: %s\n", optarg);
+      opt.error = true;
+    }
+    break;
+  case OPT_RESPAWN_DELAY:
+    if (!parse_pair(optarg, ':', &opt.respawn_delay_min, &opt.respawn_delay_max) ||
+        opt.respawn_delay_max < opt.respawn_delay_min) {
+      fprintf(stderr, "invalid respawn delay: %s\n", optarg);
+      opt.error = true;
+    }
+    break;
+  case OPT_IO_MAX:
+  case OPT_IO_WEIGHT:
+  case OPT_IO_LATENCY:
+    if (!parse_io_control(optdef->option, optarg))
+      opt.error = true;
+    break;
+  case OPT_CPUSET_CPUS:
+  case OPT_CPUSET_MEMS:
+    {
+      char **list = optdef->option == OPT_CPUSET_CPUS ?
+                    &opt.cpuset_cpus : &opt.cpuset_mems;
+      struct cpu_mask mask = {};
+
+      if (optdef->option == OPT_CPUSET_CPUS)
+        parse_cpus(optarg, &mask);
+      else
+        parse_nodes(optarg, &mask);
+      free(*list);
+      *list = NULL;
+      if (mask.size) {
+        *list = format_cpus(&mask);
+        CPU_FREE(mask.mask);
+      }
+      if (*list == NULL)
+        opt.error = true;
+    }
+    break;
+  case OPT_CPUSET_PARTITION:
+    if (strcmp(optarg, "root") &&
+        strcmp(optarg, "isolated") &&
+        strcmp(optarg, "member")) {
+      fprintf(stderr, "unknown cpuset partition type: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.cpuset_partition = optarg;
+    break;
+  case OPT_UCLAMP_MIN:
+    if (!parse_uclamp(optarg, &opt.uclamp_min, &opt.uclamp_min_util)) {
+      fprintf(stderr, "invalid utilisation clamp: %s\n", optarg);
+      opt.error = true;
+    }
+    break;
+  case OPT_UCLAMP_MAX:
+    if (!parse_uclamp(optarg, &opt.uclamp_max, &opt.uclamp_max_util)) {
+      fprintf(stderr, "invalid utilisation clamp: %s\n", optarg);
+      opt.error = true;
+    }
+    break;
+  case OPT_MEMORY_RECLAIM:
+    if (!parse_pair(optarg, ':', &opt.reclaim_interval, &opt.reclaim_target) ||
+        opt.reclaim_target > 100) {
+      fprintf(stderr, "invalid memory reclaim setting: %s\n", optarg);
+      opt.error = true;
+    }
+    break;
+  case OPT_MEMORY_RECLAIM_RATE:
+    if (!parse_memory_size(optarg, &opt.reclaim_rate) || opt.reclaim_rate == 0) {
+      fprintf(stderr, "invalid memory reclaim rate: %s\n", optarg);
+      opt.error = true;
+    }
+    break;
+  case OPT_MEMORY_RECLAIM_IDLE:
+    if (!parse_int_range(optarg, 1, 100, &value)) {
+      fprintf(stderr, "invalid idle threshold: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.reclaim_idle = value;
+    break;
+  case OPT_STARTUP_CPU_WEIGHT:
+    if (!parse_cgroup_value(optarg, 1, 10000, false)) {
+      fprintf(stderr, "startup CPU weight must be 1-10000: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.startup_cpu_weight = optarg;
+    break;
+  case OPT_STARTUP_IO_WEIGHT:
+    if (!parse_cgroup_value(optarg, 1, 10000, false)) {
+      fprintf(stderr, "startup IO weight must be 1-10000: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.startup_io_weight = optarg;
+    break;
+  case OPT_STARTUP_BOOST:
+    if (!parse_int_range(optarg, 1, INT_MAX, &value)) {
+      fprintf(stderr, "invalid startup boost duration: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.startup_boost = value;
+    break;
+  case OPT_READY_FD:
+    if (!parse_int_range(optarg, 3, INT_MAX, &value)) {
+      fprintf(stderr, "readiness fd must be 3 or more: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.ready_fd = value;
+    break;
+  case OPT_PRESSURE:
+    if (!parse_pressure(optarg))
+      opt.error = true;
+    break;
+  case OPT_SLOTS:
+    {
+      char *count = strrchr(optarg, ':');
+
+      if (count == NULL || count == optarg ||
+          !parse_int_range(count + 1, 1, 4096, &value)) {
+        fprintf(stderr, "invalid slots specification: %s\n", optarg);
+        opt.error = true;
+        break;
+      }
+      opt.slots = value;
+      free(opt.slots_file);
+      opt.slots_file = strndup(optarg, count - optarg);
+    }
+    break;
+  case OPT_SLOTS_TRY:
+    opt.slots_try = true;
+    break;
+  case OPT_SLOTS_FAIR:
+    opt.slots_fair = true;
+    break;
+  case OPT_WAIT_RESOURCES:
+    if (!parse_wait_resources(optarg))
+      opt.error = true;
+    break;
+  case OPT_WAIT_TIMEOUT:
+    if (!parse_int_range(optarg, 1, INT_MAX / 1000, &value)) {
+      fprintf(stderr, "invalid resource wait timeout: %s\n", optarg);
+      opt.error = true;
+    }
+    opt.wait_timeout = value;
+    break;
+  case OPT_JOIN:
+    opt.join_cgroup_fd = opt.join_ready_fd = -1;
+    if (sscanf(optarg, "%d:%d:%d:%d", &opt.join_child, &opt.join_pidfd,
+               &opt.join_cgroup_fd, &opt.join_ready_fd) < 2)
+      opt.error = true;
+    break;
+  case OPT_SYSCTL:
+    if (!parse_sysctl(optarg))
+      opt.error = true;
+    break;
   case OPT_SETUIDGID:
     if (usrgrp_parse(&opt.users_groups, optarg))
       opt.error = true;
@@ -900,6 +1974,10 @@ int options_parse(int argc, char *argv[]) {
     handle_option(&compat, optdef,
                   optdef->has_arg == no_argument ? NULL : argv[optind++]);
   }
+
+  /* Fill in what was not given explicitly from any profile */
+  if (opt.profile)
+    apply_profile(opt.profile);
   return optind;
 }
 
@@ -908,6 +1986,29 @@ void options_free(void) {
 
   if (opt.cpu_affinity.size)
     CPU_FREE(opt.cpu_affinity.mask);
+  if (opt.supervisor_affinity.size)
+    CPU_FREE(opt.supervisor_affinity.mask);
+  if (opt.numa_nodes.size)
+    CPU_FREE(opt.numa_nodes.mask);
+  if (opt.cpus_pool.size)
+    CPU_FREE(opt.cpus_pool.mask);
+  free(opt.slots_file);
+  free(opt.cpu_max);
+  free(opt.cpuset_cpus);
+  free(opt.cpuset_mems);
+  free(opt.uclamp_min);
+  free(opt.uclamp_max);
+  free(opt.core_sched_group);
+  free(opt.sysctls);
+  for (int i = 0; i < opt.num_io_controls; i++)
+    free(opt.io_controls[i].setting);
+  free(opt.io_controls);
+  for (int i = 0; i < opt.num_pressure_watches; i++)
+    free(opt.pressure_watches[i].throttle);
+  free(opt.pressure_watches);
+  for (int i = 0; i < opt.num_supervisor_args; i++)
+    free(opt.supervisor_args[i]);
+  free(opt.supervisor_args);
   usrgrp_free(&opt.users_groups);
   usrgrp_free(&opt.env_users_groups);
 
@@ -97,9 +97,11 @@ enum opt /* C23: :int */ {
   OPT_USER_NS,
   OPT_PID_NS,
   OPT_UTS_NS,
+  OPT_IPC_NS,
   OPT_NET_ADOPT,
   OPT_PRIVATE_RUN,
   OPT_PRIVATE_TMP,
+  OPT_PRIVATE_SHM,
   OPT_PROTECT_HOME,
   OPT_RO_HOME,
   OPT_RO_SYS,
@@ -109,6 +111,16 @@ enum opt /* C23: :int */ {
   OPT_CAPS_KEEP,
   OPT_CAPS_DROP,
   OPT_FORK_JOIN,
+  OPT_DETACH,
+  OPT_REAP,
+  OPT_SIGNAL_GROUP,
+  OPT_RESPAWN,
+  OPT_RESPAWN_DELAY,
+  OPT_SUPERVISOR_CPUS,
+  OPT_SUPERVISOR_CPU_SCHED,
+  OPT_SUPERVISOR_IO_SCHED,
+  OPT_LEAN_JOIN,
+  OPT_JOIN,
   OPT_NEW_ROOT,
   OPT_NO_NEW_PRIVS,
   OPT_CPUS,
@@ -123,6 +135,47 @@ enum opt /* C23: :int */ {
   OPT_LOGIN,
   OPT_OOM,
   OPT_HARDLIMIT,
+  OPT_CGROUP,
+  OPT_CGROUP_BASE,
+  OPT_CGROUP_DELEGATE,
+  OPT_CPU_MAX,
+  OPT_CPU_WEIGHT,
+  OPT_PIDS_MAX,
+  OPT_MEMORY_LOW,
+  OPT_MEMORY_HIGH,
+  OPT_MEMORY_MAX,
+  OPT_MEMORY_SWAP_MAX,
+  OPT_IO_MAX,
+  OPT_IO_WEIGHT,
+  OPT_IO_LATENCY,
+  OPT_CPUSET_CPUS,
+  OPT_CPUSET_MEMS,
+  OPT_CPUSET_PARTITION,
+  OPT_MEMORY_RECLAIM,
+  OPT_MEMORY_RECLAIM_RATE,
+  OPT_MEMORY_RECLAIM_IDLE,
+  OPT_STARTUP_CPU_WEIGHT,
+  OPT_STARTUP_IO_WEIGHT,
+  OPT_STARTUP_BOOST,
+  OPT_READY_FD,
+  OPT_PRESSURE,
+  OPT_SYSCTL,
+  OPT_WAIT_RESOURCES,
+  OPT_WAIT_TIMEOUT,
+  OPT_SLOTS,
+  OPT_SLOTS_TRY,
+  OPT_SLOTS_FAIR,
+  OPT_UCLAMP_MIN,
+  OPT_UCLAMP_MAX,
+  OPT_PROFILE,
+  OPT_TIMER_SLACK,
+  OPT_AUTOGROUP_NICE,
+  OPT_NUMA_BIND,
+  OPT_NUMA_PREFERRED,
+  OPT_NUMA_INTERLEAVE,
+  OPT_NUMA,
+  OPT_CPUS_SPREAD,
+  OPT_CORE_SCHED,
 
   /* Keep at end */
   OPT_EXIT,
@@ -165,6 +218,71 @@ enum cap_op {
   CAP_OP_DROP,
 };
 
+struct cpu_mask {
+  cpu_set_t *mask;
+  int size;
+};
+
+/* The argument to sched_setattr(2), which cannot be had from
+ * <linux/sched/types.h> alongside glibc's <sched.h> */
+struct sched_attributes {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+  uint32_t sched_util_min;
+  uint32_t sched_util_max;
+};
+
+struct sysctl {
+  const char *key;
+  const char *value;
+};
+
+struct io_control {
+  const char *file;
+  const char *device;
+  char *setting;
+};
+
+enum pressure_action {
+  PRESSURE_LOG = 0,
+  PRESSURE_SIGNAL,
+  PRESSURE_THROTTLE,
+};
+
+#define MAX_PRESSURE_WATCHES 6
+
+struct pressure_watch {
+  const char *resource;
+  bool system;
+  bool full;
+  int stall_ms;
+  int window_ms;
+  enum pressure_action action;
+  int signal;
+  char *throttle;
+};
+
+enum wait_kind {
+  WAIT_MEMORY = 0,
+  WAIT_PRESSURE,
+  WAIT_LOAD,
+};
+
+#define MAX_WAIT_CONDITIONS 8
+
+struct wait_condition {
+  enum wait_kind kind;
+  const char *resource;
+  bool full;
+  double limit;
+};
+
 struct options_file {
   struct options_file *next;
   char content[];
@@ -196,13 +314,42 @@ struct options {
   bool lock_wait;
   bool lock_nowait_override;
   bool lock_quiet;
-  int sched_policy;
+  struct sched_attributes sched_attr;
   int ionice_prio;
   const char *lock_file;
+  char *slots_file;
+  int slots;
+  bool slots_try;
+  bool slots_fair;
   const char *env_dir;
   const char *chroot;
   const char *chdir;
   const char *net_adopt;
+  const char *cgroup;
+  const char *cgroup_base;
+  char *cpu_max;
+  const char *cpu_weight;
+  const char *pids_max;
+  const char *memory_low;
+  const char *memory_high;
+  const char *memory_max;
+  const char *memory_swap_max;
+  char *cpuset_cpus;
+  char *cpuset_mems;
+  const char *cpuset_partition;
+  char *uclamp_min;
+  char *uclamp_max;
+  unsigned int uclamp_min_util;
+  unsigned int uclamp_max_util;
+  int reclaim_interval;
+  int reclaim_target;
+  int reclaim_idle;
+  unsigned long long reclaim_rate;
+  const char *startup_cpu_weight;
+  const char *startup_io_weight;
+  int startup_boost;
+  int ready_fd;
+  const char *shm_size;
   struct users_groups users_groups;
   struct users_groups env_users_groups;
   struct limit rlimit_data;
@@ -228,11 +375,44 @@ struct options {
   cap_bits_t caps;
   unsigned int umask;
   long oom_adjust;
-
-  struct {
-    cpu_set_t *mask;
-    int size;
-  } cpu_affinity;
+  const char *profile;
+  unsigned long timer_slack;
+  int autogroup_nice;
+  bool autogroup_quiet;
+  char *core_sched_group;
+  struct sysctl *sysctls;
+  int num_sysctls;
+  struct io_control *io_controls;
+  int num_io_controls;
+  struct pressure_watch *pressure_watches;
+  int num_pressure_watches;
+  struct wait_condition wait_conditions[MAX_WAIT_CONDITIONS];
+  int num_wait_conditions;
+  int wait_timeout;
+  int respawn_burst;
+  int respawn_interval;
+  int respawn_delay_min;
+  int respawn_delay_max;
+  int join_child;
+  int join_pidfd;
+  int join_cgroup_fd;
+  int join_ready_fd;
+
+  /* Supervisor options to pass on to the lean join helper */
+  char **supervisor_args;
+  int num_supervisor_args;
+
+  struct cpu_mask cpu_affinity;
+  struct cpu_mask supervisor_affinity;
+  struct cpu_mask numa_nodes;
+  struct cpu_mask cpus_pool;
+  int cpus_auto;
+  int cpus_exclusive;
+  bool cpus_spread;
+  int numa_policy;
+  bool numa_auto;
+  struct sched_attributes supervisor_sched_attr;
+  int supervisor_ionice_prio;
 };
 
 extern struct options opt;
@@ -256,6 +436,10 @@ static inline void enable(enum opt option) {
 }
 
 bool options_init(void);
+bool parse_cpu_range(const char *str, int range[3], int *max);
+void parse_cpus(char *spec, struct cpu_mask *affinity);
+void parse_nodes(char *spec, struct cpu_mask *nodes);
+char *format_cpus(const struct cpu_mask *set);
 void options_print(FILE *out);
 void options_print_positional(FILE *out);
 void options_explain_positional(FILE *out);
@@ -0,0 +1,377 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+/* xchpst: eXtended Change Process State
+ * A tool that is backwards compatible with chpst(8) from runit(8),
+ * offering additional options to harden process with namespace isolation
+ * and more. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/pidfd.h>
+
+#include "xchpst.h"
+#include "options.h"
+#include "cgroup.h"
+#include "psi.h"
+
+/* Runtime state of each of opt.pressure_watches */
+static struct {
+  int fd;
+  bool throttled;
+  struct timespec last_event;
+} watching[MAX_PRESSURE_WATCHES];
+static int watched_cgroup_fd = -1;
+static int cpu_max_fd = -1;
+static int num_watching = 0;
+
+static const char *action_names[] = {
+  [PRESSURE_LOG] = "log",
+  [PRESSURE_SIGNAL] = "signal",
+  [PRESSURE_THROTTLE] = "throttle",
+};
+
+/* Register a PSI trigger, which raises POLLPRI whenever the stall time
+ * within a window exceeds the threshold */
+int psi_trigger(int dirfd, const char *path, bool full,
+                long stall_us, long window_us) {
+  char trigger[64];
+  int saved_errno;
+  int fd;
+
+  fd = openat(dirfd, path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+
+  snprintf(trigger, sizeof trigger, "%s %ld %ld",
+           full ? "full" : "some", stall_us, window_us);
+  if (write(fd, trigger, strlen(trigger) + 1) == -1) {
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+/* Read the 10s, 60s and 300s stall averages */
+bool psi_averages(int fd, bool full, double avgs[3]) {
+  const char *kind = full ? "full" : "some";
+  char buf[256];
+  char *line;
+  char *save;
+  ssize_t len;
+
+  len = pread(fd, buf, sizeof buf - 1, 0);
+  if (len <= 0)
+    return false;
+  buf[len] = '\0';
+
+  for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+    if (!strncmp(line, kind, 4))
+      return sscanf(line + 4, " avg10=%lf avg60=%lf avg300=%lf",
+                    &avgs[0], &avgs[1], &avgs[2]) == 3;
+  return false;
+}
+
+void psi_watch(int cgroup_fd) {
+  const struct pressure_watch *watch;
+  char path[32];
+  int dirfd;
+  int i;
+
+  watched_cgroup_fd = cgroup_fd;
+  for (i = 0; i < opt.num_pressure_watches; i++) {
+    watch = &opt.pressure_watches[i];
+    if (watch->system || cgroup_fd == -1) {
+      dirfd = AT_FDCWD;
+      snprintf(path, sizeof path, "/proc/pressure/%s", watch->resource);
+    } else {
+      dirfd = cgroup_fd;
+      snprintf(path, sizeof path, "%s.pressure", watch->resource);
+    }
+
+    watching[i].throttled = false;
+    watching[i].fd = psi_trigger(dirfd, path, watch->full,
+                                 watch->stall_ms * 1000L,
+                                 watch->window_ms * 1000L);
+    if (watching[i].fd == -1)
+      fprintf(stderr, "warning: could not watch %s, %s%s\n", path, strerror(errno),
+              errno == EINVAL ?
+              " (without CAP_SYS_RESOURCE the window must be a multiple of 2s)" : "");
+  }
+  num_watching = opt.num_pressure_watches;
+
+  /* Keep cpu.max open for throttling in case privileges are dropped */
+  for (i = 0; i < num_watching && cgroup_fd != -1; i++)
+    if (opt.pressure_watches[i].action == PRESSURE_THROTTLE) {
+      cpu_max_fd = openat(cgroup_fd, "cpu.max", O_WRONLY | O_CLOEXEC);
+      if (cpu_max_fd == -1)
+        perror("warning: could not open cpu.max for throttling");
+      break;
+    }
+}
+
+/* Throttles are lifted after two windows without a further event */
+int psi_timeout(void) {
+  long long timeout = -1;
+  long long remaining;
+  int i;
+
+  for (i = 0; i < num_watching; i++) {
+    if (!watching[i].throttled)
+      continue;
+    remaining = 2LL * opt.pressure_watches[i].window_ms -
+                elapsed_ms(&watching[i].last_event);
+    if (remaining < 0)
+      remaining = 0;
+    if (timeout == -1 || remaining < timeout)
+      timeout = remaining;
+  }
+  return timeout;
+}
+
+int psi_pollfds(struct pollfd *fds, int max) {
+  int n = 0;
+  int i;
+
+  for (i = 0; i < num_watching && n < max; i++)
+    if (watching[i].fd != -1)
+      fds[n++] = (struct pollfd) { .fd = watching[i].fd, .events = POLLPRI };
+  return n;
+}
+
+static void set_throttle(const char *value) {
+  if (cpu_max_fd == -1 ||
+      pwrite(cpu_max_fd, value, strlen(value), 0) == -1)
+    fprintf(stderr, "could not set cpu.max to %s, %s\n", value,
+            cpu_max_fd == -1 ? "not open" : strerror(errno));
+}
+
+static void pressure_event(int i, pid_t child, int pidfd) {
+  const struct pressure_watch *watch = &opt.pressure_watches[i];
+  double avgs[3] = {};
+
+  clock_gettime(CLOCK_MONOTONIC, &watching[i].last_event);
+  psi_averages(watching[i].fd, watch->full, avgs);
+  fprintf(stderr, "pressure: resource=%s scope=%s kind=%s "
+          "threshold=%d/%dms avg10=%.2f avg60=%.2f avg300=%.2f action=%s\n",
+          watch->resource,
+          watch->system || watched_cgroup_fd == -1 ? "system" : "cgroup",
+          watch->full ? "full" : "some",
+          watch->stall_ms, watch->window_ms,
+          avgs[0], avgs[1], avgs[2],
+          action_names[watch->action]);
+
+  switch (watch->action) {
+  case PRESSURE_LOG:
+    break;
+  case PRESSURE_SIGNAL:
+    if (set(OPT_SIGNAL_GROUP))
+      kill(-child, watch->signal);
+    else
+      pidfd_send_signal(pidfd, watch->signal, NULL, 0);
+    break;
+  case PRESSURE_THROTTLE:
+    if (!watching[i].throttled)
+      set_throttle(watch->throttle);
+    watching[i].throttled = true;
+    break;
+  }
+}
+
+void psi_service(const struct pollfd *fds, int nfds, pid_t child, int pidfd) {
+  bool throttled = false;
+  bool lifted = false;
+  int i, j;
+
+  for (j = 0; j < nfds; j++) {
+    for (i = 0; i < num_watching && watching[i].fd != fds[j].fd; i++);
+    if (i == num_watching)
+      continue;
+    if (fds[j].revents & POLLERR) {
+      fprintf(stderr, "pressure watch on %s went away\n",
+              opt.pressure_watches[i].resource);
+      close(watching[i].fd);
+      watching[i].fd = -1;
+    } else if (fds[j].revents & POLLPRI) {
+      pressure_event(i, child, pidfd);
+    }
+  }
+
+  for (i = 0; i < num_watching; i++) {
+    if (watching[i].throttled &&
+        elapsed_ms(&watching[i].last_event) >= 2LL * opt.pressure_watches[i].window_ms) {
+      watching[i].throttled = false;
+      lifted = true;
+    }
+    throttled |= watching[i].throttled;
+  }
+
+  if (lifted && !throttled) {
+    set_throttle(opt.cpu_max ? opt.cpu_max : "max");
+    if (is_verbose())
+      fprintf(stderr, "pressure subsided; throttle lifted\n");
+  }
+}
+
+/* Window over which pressure must stay low before conditions are
+ * checked again; the least allowed without CAP_SYS_RESOURCE */
+#define WAIT_WINDOW_MS 2000
+
+static bool read_mem_available(double *bytes) {
+  unsigned long long kb;
+  char line[128];
+  bool found = false;
+  FILE *f;
+
+  f = fopen("/proc/meminfo", "re");
+  if (f == NULL)
+    return false;
+  while (!found && fgets(line, sizeof line, f))
+    found = sscanf(line, "MemAvailable: %llu kB", &kb) == 1;
+  fclose(f);
+  if (found)
+    *bytes = kb * 1024.0;
+  return found;
+}
+
+static bool read_load(double *load) {
+  bool found;
+  FILE *f;
+
+  f = fopen("/proc/loadavg", "re");
+  if (f == NULL)
+    return false;
+  found = fscanf(f, "%lf", load) == 1;
+  fclose(f);
+  return found;
+}
+
+/* Check each condition, describing the first one not met */
+static bool resources_available(const int *fds, char *why, size_t len) {
+  const struct wait_condition *cond;
+  double avgs[3];
+  double value;
+  int i;
+
+  for (i = 0; i < opt.num_wait_conditions; i++) {
+    cond = &opt.wait_conditions[i];
+    switch (cond->kind) {
+    case WAIT_MEMORY:
+      if (!read_mem_available(&value))
+        continue;
+      if (value < cond->limit) {
+        snprintf(why, len, "available memory %.0fM below %.0fM",
+                 value / 1048576, cond->limit / 1048576);
+        return false;
+      }
+      break;
+    case WAIT_PRESSURE:
+      if (fds[i] == -1 || !psi_averages(fds[i], cond->full, avgs))
+        continue;
+      if (avgs[0] > cond->limit) {
+        snprintf(why, len, "%s %s pressure %.2f above %.2f",
+                 cond->resource, cond->full ? "full" : "some",
+                 avgs[0], cond->limit);
+        return false;
+      }
+      break;
+    case WAIT_LOAD:
+      if (!read_load(&value))
+        continue;
+      if (value > cond->limit) {
+        snprintf(why, len, "load %.2f above %.2f", value, cond->limit);
+        return false;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+/* Hold the launch until there is headroom on the system. Pressure
+ * conditions are watched with triggers set at the limit, so that while
+ * stalls persist the wait is spent blocked in poll() and conditions are
+ * only checked again once a whole window has passed quietly. */
+int psi_wait_resources(void) {
+  const struct wait_condition *cond;
+  struct pollfd fds[MAX_WAIT_CONDITIONS];
+  int trigger[MAX_WAIT_CONDITIONS];
+  struct timespec started;
+  struct timespec quiet;
+  char path[32];
+  char why[80];
+  long long remaining;
+  long long timeout;
+  bool waiting = false;
+  int nfds = 0;
+  int rc = 0;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  for (i = 0; i < opt.num_wait_conditions; i++) {
+    cond = &opt.wait_conditions[i];
+    trigger[i] = -1;
+    if (cond->kind != WAIT_PRESSURE)
+      continue;
+    snprintf(path, sizeof path, "/proc/pressure/%s", cond->resource);
+    trigger[i] = psi_trigger(AT_FDCWD, path, cond->full,
+                             cond->limit * WAIT_WINDOW_MS * 10,
+                             WAIT_WINDOW_MS * 1000L);
+    if (trigger[i] == -1)
+      fprintf(stderr, "warning: could not watch %s, %s\n", path, strerror(errno));
+    else
+      fds[nfds++] = (struct pollfd) { .fd = trigger[i], .events = POLLPRI };
+  }
+
+  while (!resources_available(trigger, why, sizeof why)) {
+    if (opt.wait_timeout &&
+        elapsed_ms(&started) >= opt.wait_timeout * 1000LL) {
+      fprintf(stderr, "timed out waiting for resources: %s\n", why);
+      rc = -1;
+      break;
+    }
+    if (is_verbose() && !waiting)
+      fprintf(stderr, "waiting for resources: %s\n", why);
+    waiting = true;
+
+    clock_gettime(CLOCK_MONOTONIC, &quiet);
+    while ((remaining = WAIT_WINDOW_MS - elapsed_ms(&quiet)) > 0) {
+      timeout = remaining;
+      if (opt.wait_timeout) {
+        timeout = opt.wait_timeout * 1000LL - elapsed_ms(&started);
+        if (timeout <= 0)
+          break;
+        if (remaining < timeout)
+          timeout = remaining;
+      }
+      rc = poll(fds, nfds, timeout);
+      if (rc == -1 && errno != EINTR) {
+        perror("poll");
+        goto finish;
+      }
+      for (i = 0; i < nfds; i++)
+        if (fds[i].revents & POLLERR)
+          fds[i].fd = -1;
+        else if (fds[i].revents & POLLPRI)
+          clock_gettime(CLOCK_MONOTONIC, &quiet);
+      rc = 0;
+    }
+  }
+
+  if (rc == 0 && waiting && is_verbose())
+    fprintf(stderr, "resources available after %lldms\n", elapsed_ms(&started));
+
+finish:
+  for (i = 0; i < opt.num_wait_conditions; i++)
+    if (trigger[i] != -1)
+      close(trigger[i]);
+  return rc;
+}
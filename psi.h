@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _PSI_H
+#define _PSI_H
+
+#include <poll.h>
+#include <sys/types.h>
+
+extern int psi_trigger(int dirfd, const char *path, bool full,
+                       long stall_us, long window_us);
+extern bool psi_averages(int fd, bool full, double avgs[3]);
+extern void psi_watch(int cgroup_fd);
+extern int psi_timeout(void);
+extern int psi_pollfds(struct pollfd *fds, int max);
+extern void psi_service(const struct pollfd *fds, int nfds,
+                        pid_t child, int pidfd);
+extern int psi_wait_resources(void);
+
+#endif
@@ -0,0 +1,306 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+/* xchpst: eXtended Change Process State
+ * A tool that is backwards compatible with chpst(8) from runit(8),
+ * offering additional options to harden process with namespace isolation
+ * and more. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/sched.h>
+#include <sys/file.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "xchpst.h"
+#include "options.h"
+#include "schedule.h"
+
+/* Missing in glibc */
+int sched_get_attr(struct sched_attributes *attr) {
+  return syscall(SYS_sched_getattr, 0, attr, sizeof *attr, 0);
+}
+
+int sched_set_attr(const struct sched_attributes *attr) {
+  return syscall(SYS_sched_setattr, 0, attr, 0);
+}
+
+static void explain_rt_failure(const struct sched_attributes *attr,
+                               const char *whose) {
+  struct rlimit limit;
+
+  if (errno == EPERM &&
+      getrlimit(RLIMIT_RTPRIO, &limit) == 0 &&
+      attr->sched_priority > limit.rlim_cur)
+    fprintf(stderr, "could not set %s real-time priority %u, "
+            "which exceeds RLIMIT_RTPRIO of %llu without CAP_SYS_NICE\n",
+            whose, attr->sched_priority, (unsigned long long) limit.rlim_cur);
+  else
+    fprintf(stderr, "could not set %s real-time policy at priority %u, %s\n",
+            whose, attr->sched_priority, strerror(errno));
+}
+
+static void explain_deadline_failure(const struct sched_attributes *attr,
+                                     const char *whose) {
+  switch (errno) {
+  case EBUSY:
+    fprintf(stderr, "%s deadline reservation of %llu/%lluns refused by "
+            "admission control, as it would exceed the real-time bandwidth "
+            "available to its CPUs\n", whose,
+            (unsigned long long) attr->sched_runtime,
+            (unsigned long long) attr->sched_period);
+    break;
+  case EPERM:
+    fprintf(stderr, "could not set %s deadline policy: needs CAP_SYS_NICE "
+            "and affinity to every CPU of its root domain\n", whose);
+    break;
+  default:
+    fprintf(stderr, "could not set %s deadline policy, %s\n",
+            whose, strerror(errno));
+  }
+}
+
+/* Apply scheduling attributes, explaining any refusal. Failing to get a
+ * real-time or deadline policy is fatal, since the workload cannot be
+ * expected to meet its timing otherwise. */
+int sched_apply(const struct sched_attributes *attr, const char *whose) {
+  struct sched_attributes unclamped;
+  struct sched_attributes fair;
+  int nice;
+  int rc;
+
+  /* The fair policies take a niceness too, so keep whatever -n or the
+   * caller has set rather than resetting it to zero */
+  if (attr->sched_policy == SCHED_OTHER ||
+      attr->sched_policy == SCHED_BATCH ||
+      attr->sched_policy == SCHED_IDLE) {
+    errno = 0;
+    nice = getpriority(PRIO_PROCESS, 0);
+    if (nice != -1 || errno == 0) {
+      fair = *attr;
+      fair.sched_nice = nice;
+      attr = &fair;
+    }
+  }
+
+  rc = sched_set_attr(attr);
+
+  /* Utilisation clamps are a hint, so do without them if need be */
+  if (rc == -1 && errno == EOPNOTSUPP &&
+      (attr->sched_flags & SCHED_FLAG_UTIL_CLAMP)) {
+    fprintf(stderr, "warning: utilisation clamping not supported by the kernel\n");
+    if (attr->sched_flags & SCHED_FLAG_KEEP_POLICY)
+      return 0;
+    unclamped = *attr;
+    unclamped.sched_flags &= ~SCHED_FLAG_UTIL_CLAMP;
+    attr = &unclamped;
+    rc = sched_set_attr(attr);
+  }
+
+  if (rc == 0) {
+    if (is_verbose() && (attr->sched_flags & SCHED_FLAG_KEEP_POLICY))
+      fprintf(stderr, "set %s utilisation clamps\n", whose);
+    else if (is_verbose())
+      fprintf(stderr, "set %s scheduler policy %u\n", whose, attr->sched_policy);
+    return 0;
+  }
+
+  switch (attr->sched_policy) {
+  case SCHED_FIFO:
+  case SCHED_RR:
+    explain_rt_failure(attr, whose);
+    return -1;
+  case SCHED_DEADLINE:
+    explain_deadline_failure(attr, whose);
+    return -1;
+  default:
+    fprintf(stderr, "could not change %s scheduler policy, %s\n",
+            whose, strerror(errno));
+    return 0;
+  }
+}
+
+static const char *core_sched_dir = "core-sched";
+
+static int core_sched_create(void) {
+  return prctl(PR_SCHED_CORE, PR_SCHED_CORE_CREATE, 0,
+               PR_SCHED_CORE_SCOPE_THREAD_GROUP, 0);
+}
+
+/* Open and lock the membership record of a core scheduling group */
+static FILE *open_group(const char *group) {
+  FILE *members = NULL;
+  int dir_fd = -1;
+  int fd = -1;
+
+  if (get_run_dir() == -1 ||
+      ensure_dir(get_run_dir(), core_sched_dir, &dir_fd, 0700) == -1 ||
+      (fd = openat(dir_fd, group, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1 ||
+      (members = fdopen(fd, "r+")) == NULL) {
+    fprintf(stderr, "could not open core scheduling group %s, %s\n",
+            group, strerror(errno));
+    if (fd != -1)
+      close(fd);
+  } else if (flock(fd, LOCK_EX) == -1) {
+    perror("could not lock core scheduling group");
+    fclose(members);
+    members = NULL;
+  }
+  if (dir_fd != -1)
+    close(dir_fd);
+  return members;
+}
+
+static bool rewrite_group(FILE *members, const char *kept, const char *group) {
+  if (ftruncate(fileno(members), 0) == -1 ||
+      fseek(members, 0, SEEK_SET) == -1 ||
+      (kept && fputs(kept, members) == EOF) ||
+      fflush(members) == EOF) {
+    fprintf(stderr, "could not record core scheduling group %s, %s\n",
+            group, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+/* Take the cookie of any live member of the group, or else start the
+ * group with a new cookie, and record ourselves as a member so that
+ * the group outlives whichever process happened to create it. */
+static int core_sched_join(const char *group) {
+  unsigned long long own_start;
+  unsigned long long start;
+  unsigned long long actual;
+  pid_t shared_from = 0;
+  pid_t live = 0;
+  int share_errno = 0;
+  pid_t pid;
+  FILE *members;
+  FILE *out;
+  char *kept = NULL;
+  size_t kept_len = 0;
+  int rc = -1;
+
+  if (!process_start_time(getpid(), &own_start)) {
+    fprintf(stderr, "could not identify own process\n");
+    return -1;
+  }
+  if ((members = open_group(group)) == NULL)
+    return -1;
+
+  out = open_memstream(&kept, &kept_len);
+  if (out == NULL) {
+    perror("open_memstream");
+    goto finish;
+  }
+  while (fscanf(members, "%d %llu", &pid, &start) == 2) {
+    if (pid == getpid() ||
+        !process_start_time(pid, &actual) || actual != start)
+      continue;
+    live = pid;
+    if (shared_from == 0) {
+      if (prctl(PR_SCHED_CORE, PR_SCHED_CORE_SHARE_FROM, pid,
+                PR_SCHED_CORE_SCOPE_THREAD, 0) == 0)
+        shared_from = pid;
+      else
+        share_errno = errno;
+    }
+    fprintf(out, "%d %llu\n", pid, start);
+  }
+  fprintf(out, "%d %llu\n", getpid(), own_start);
+  fclose(out);
+
+  /* A cookie of our own would quietly split the group */
+  if (live && shared_from == 0) {
+    fprintf(stderr, "could not share core scheduling cookie of group %s "
+            "from process %d, %s\n", group, live, strerror(share_errno));
+    goto finish;
+  }
+
+  if (shared_from == 0 && core_sched_create() == -1) {
+    fprintf(stderr, "could not create core scheduling cookie, %s\n",
+            strerror(errno));
+    goto finish;
+  }
+
+  if (!rewrite_group(members, kept, group))
+    goto finish;
+
+  if (is_verbose() && shared_from)
+    fprintf(stderr, "joined core scheduling group %s through process %d\n",
+            group, shared_from);
+  else if (is_verbose())
+    fprintf(stderr, "started core scheduling group %s\n", group);
+  rc = 0;
+
+finish:
+  free(kept);
+  fclose(members);
+  return rc;
+}
+
+/* Hand our group membership to a detached child that outlives us */
+void core_sched_transfer(pid_t child) {
+  unsigned long long own_start, child_start;
+  unsigned long long start;
+  char *kept = NULL;
+  size_t kept_len = 0;
+  FILE *members;
+  FILE *out;
+  pid_t pid;
+
+  if (!process_start_time(getpid(), &own_start) ||
+      !process_start_time(child, &child_start) ||
+      (members = open_group(opt.core_sched_group)) == NULL)
+    return;
+
+  out = open_memstream(&kept, &kept_len);
+  if (out != NULL) {
+    while (fscanf(members, "%d %llu", &pid, &start) == 2)
+      if (pid == getpid() && start == own_start)
+        fprintf(out, "%d %llu\n", child, child_start);
+      else
+        fprintf(out, "%d %llu\n", pid, start);
+    fclose(out);
+    rewrite_group(members, kept, opt.core_sched_group);
+    free(kept);
+  }
+  fclose(members);
+}
+
+/* Only tasks sharing a core scheduling cookie run at once on the SMT
+ * siblings of a core. The cookie is inherited across fork and exec. */
+int core_sched_apply(void) {
+  unsigned long cookie;
+
+  if (prctl(PR_SCHED_CORE, PR_SCHED_CORE_GET, 0,
+            PR_SCHED_CORE_SCOPE_THREAD, &cookie) == -1) {
+    if (errno == ENODEV) {
+      if (is_verbose())
+        fprintf(stderr, "no SMT siblings, so core scheduling is moot\n");
+      return 0;
+    }
+    if (errno == EINVAL)
+      fprintf(stderr, "core scheduling is not supported by the kernel\n");
+    else
+      perror("could not get core scheduling cookie");
+    return -1;
+  }
+
+  if (opt.core_sched_group)
+    return core_sched_join(opt.core_sched_group);
+
+  if (core_sched_create() == -1) {
+    fprintf(stderr, "could not create core scheduling cookie, %s\n",
+            strerror(errno));
+    return -1;
+  }
+  if (is_verbose())
+    fprintf(stderr, "created core scheduling cookie\n");
+  return 0;
+}
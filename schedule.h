@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _SCHEDULE_H
+#define _SCHEDULE_H
+
+#include "options.h"
+
+extern int sched_get_attr(struct sched_attributes *attr);
+extern int sched_set_attr(const struct sched_attributes *attr);
+extern int sched_apply(const struct sched_attributes *attr, const char *whose);
+extern int core_sched_apply(void);
+extern void core_sched_transfer(pid_t child);
+
+#endif
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+/* xchpst: eXtended Change Process State
+ * A tool that is backwards compatible with chpst(8) from runit(8),
+ * offering additional options to harden process with namespace isolation
+ * and more. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xchpst.h"
+#include "options.h"
+#include "slots.h"
+
+/* Backoff between attempts to find a free slot */
+#define SLOT_BACKOFF_MIN_MS 10
+#define SLOT_BACKOFF_MAX_MS 1000
+
+/* Each slot is a one byte open file description lock on the slots file,
+ * which like flock(2) is held across fork and exec and released when the
+ * last holder exits. The byte after the slots is the queue lock. */
+static int lock_byte(int fd, off_t byte, short type, bool wait) {
+  struct flock lock = {
+    .l_type = type,
+    .l_whence = SEEK_SET,
+    .l_start = byte,
+    .l_len = 1,
+  };
+
+  return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+}
+
+static int try_slots(int fd) {
+  int slot;
+
+  for (slot = 0; slot < opt.slots; slot++)
+    if (lock_byte(fd, slot, F_WRLCK, false) == 0)
+      return slot;
+    else if (errno != EAGAIN && errno != EACCES)
+      return -1;
+  errno = EAGAIN;
+  return -1;
+}
+
+/* Take one of the slots, returning the descriptor holding it, which is
+ * deliberately inherited by the program */
+int slots_acquire(void) {
+  int backoff = SLOT_BACKOFF_MIN_MS;
+  struct timespec started;
+  struct timespec delay;
+  long long waited;
+  char value[24];
+  int saved_errno;
+  bool queued = false;
+  int slot;
+  int fd;
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  fd = open(opt.slots_file, O_WRONLY | O_NDELAY | O_APPEND | O_CREAT, 0600);
+  if (fd == -1)
+    return -1;
+
+  /* Only the head of the queue competes for a slot, so launches are
+   * admitted in roughly the order they arrived */
+  if (opt.slots_fair && !opt.slots_try) {
+    if (lock_byte(fd, opt.slots, F_WRLCK, true) == -1)
+      goto fail;
+    queued = true;
+  }
+
+  while ((slot = try_slots(fd)) == -1) {
+    if (errno != EAGAIN || opt.slots_try)
+      goto fail;
+    delay = (struct timespec) {
+      .tv_sec = backoff / 1000,
+      .tv_nsec = (backoff % 1000) * 1000000L,
+    };
+    nanosleep(&delay, NULL);
+    if ((backoff *= 2) > SLOT_BACKOFF_MAX_MS)
+      backoff = SLOT_BACKOFF_MAX_MS;
+  }
+
+  if (queued)
+    lock_byte(fd, opt.slots, F_UNLCK, false);
+
+  waited = elapsed_ms(&started);
+  if (is_verbose())
+    fprintf(stderr, "obtained slot %d of %d in %s after %lldms\n",
+            slot, opt.slots, opt.slots_file, waited);
+  snprintf(value, sizeof value, "%d", slot);
+  setenv("XCHPST_SLOT", value, 1);
+  snprintf(value, sizeof value, "%lld", waited);
+  setenv("XCHPST_SLOT_WAIT_MS", value, 1);
+  return fd;
+
+fail:
+  saved_errno = errno == EACCES ? EAGAIN : errno;
+  close(fd);
+  errno = saved_errno;
+  return -1;
+}
@@ -0,0 +1,9 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _SLOTS_H
+#define _SLOTS_H
+
+extern int slots_acquire(void);
+
+#endif
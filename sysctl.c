@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+/* xchpst: eXtended Change Process State
+ * A tool that is backwards compatible with chpst(8) from runit(8),
+ * offering additional options to harden process with namespace isolation
+ * and more. */
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xchpst.h"
+#include "options.h"
+#include "sysctl.h"
+
+/* Only keys under these prefixes follow the namespace of the writer;
+ * anything else would change the host. */
+static const struct {
+  const char *prefix;
+  int ns;
+} namespaced_sysctls[] = {
+  { "net/", CLONE_NEWNET },
+  { "kernel/shm", CLONE_NEWIPC },
+  { "kernel/msg", CLONE_NEWIPC },
+  { "kernel/sem", CLONE_NEWIPC },
+  { "fs/mqueue/", CLONE_NEWIPC },
+  { "kernel/hostname", CLONE_NEWUTS },
+  { "kernel/domainname", CLONE_NEWUTS },
+};
+#define max_namespaced_sysctls \
+  ((ssize_t) (sizeof namespaced_sysctls / sizeof *namespaced_sysctls))
+
+/* Convert a sysctl(8)-style key to a path under /proc/sys. As with
+ * sysctl(8), dots separate components unless the key uses slashes. */
+static char *sysctl_path(const char *key) {
+  const char *sep = strpbrk(key, "./");
+  char *path;
+  char *comp;
+  char *next;
+  size_t len;
+
+  if (asprintf(&path, "/proc/sys/%s", key) == -1)
+    return NULL;
+
+  comp = path + strlen("/proc/sys/");
+  if (sep && *sep == '.')
+    for (next = comp; (next = strchr(next, '.')); *next++ = '/');
+
+  /* Refuse anything that could escape the intended subtree */
+  for (; comp; comp = next ? next + 1 : NULL) {
+    next = strchr(comp, '/');
+    len = next ? (size_t) (next - comp) : strlen(comp);
+    if (len == 0 ||
+        !strncmp(comp, ".", len) ||
+        !strncmp(comp, "..", len)) {
+      free(path);
+      return NULL;
+    }
+  }
+  return path;
+}
+
+bool sysctls_check(int namespaces) {
+  bool good = true;
+  char *path;
+  int i, j;
+
+  for (i = 0; i < opt.num_sysctls; i++) {
+    path = sysctl_path(opt.sysctls[i].key);
+    if (path == NULL) {
+      fprintf(stderr, "invalid sysctl key: %s\n", opt.sysctls[i].key);
+      good = false;
+      continue;
+    }
+    for (j = 0;
+         j < max_namespaced_sysctls &&
+         strncmp(path + strlen("/proc/sys/"), namespaced_sysctls[j].prefix,
+                 strlen(namespaced_sysctls[j].prefix));
+         j++);
+    if (j == max_namespaced_sysctls ||
+        (namespaced_sysctls[j].ns & namespaces) == 0) {
+      fprintf(stderr, "sysctl %s is not confined to a new namespace\n",
+              opt.sysctls[i].key);
+      good = false;
+    }
+    free(path);
+  }
+  return good;
+}
+
+int apply_sysctls(void) {
+  char *path;
+  int rc = 0;
+  int i;
+
+  for (i = 0; rc == 0 && i < opt.num_sysctls; i++) {
+    path = sysctl_path(opt.sysctls[i].key);
+    if (path == NULL)
+      return -1;
+    rc = write_once(path, "%s\n", opt.sysctls[i].value);
+    if (rc == 0 && is_verbose())
+      fprintf(stderr, "set sysctl %s to %s\n",
+              opt.sysctls[i].key, opt.sysctls[i].value);
+    free(path);
+  }
+  return rc ? -1 : 0;
+}
@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _SYSCTL_H
+#define _SYSCTL_H
+
+extern bool sysctls_check(int namespaces);
+extern int apply_sysctls(void);
+
+#endif
@@ -0,0 +1,268 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+/* xchpst: eXtended Change Process State
+ * A tool that is backwards compatible with chpst(8) from runit(8),
+ * offering additional options to harden process with namespace isolation
+ * and more. */
+
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+
+#include "xchpst.h"
+#include "options.h"
+#include "topology.h"
+
+static const char *cpu_dir = "/sys/devices/system/cpu";
+static const char *node_dir = "/sys/devices/system/node";
+
+/* All masks are sized for every CPU the system could have */
+static int num_cpus;
+static size_t mask_size;
+
+static cpu_set_t *new_mask(void) {
+  cpu_set_t *mask = CPU_ALLOC(num_cpus);
+
+  if (mask == NULL)
+    perror("CPU_ALLOC");
+  else
+    CPU_ZERO_S(mask_size, mask);
+  return mask;
+}
+
+/* Add the CPUs in a list such as "0-3,8-11" or "0-15:2" */
+static bool add_list(cpu_set_t *mask, char *list) {
+  char *tok;
+  int range[3];
+  int cpu;
+
+  while ((tok = strsep(&list, ","))) {
+    if (*tok == '\0')
+      continue;
+    if (!parse_cpu_range(tok, range, NULL))
+      return false;
+    for (cpu = range[0]; cpu <= range[1]; cpu += range[2]) {
+      if (cpu >= num_cpus) {
+        fprintf(stderr, "CPU %d does not exist\n", cpu);
+        return false;
+      }
+      CPU_SET_S(cpu, mask_size, mask);
+    }
+  }
+  return true;
+}
+
+/* Read a line from a sysfs file, treating an absent file as empty */
+static bool read_line(const char *path, char *buf, size_t len, bool optional) {
+  FILE *f;
+
+  *buf = '\0';
+  f = fopen(path, "re");
+  if (f == NULL) {
+    if (!optional)
+      fprintf(stderr, "could not read %s, %s\n", path, strerror(errno));
+    return optional;
+  }
+  if (fgets(buf, len, f) == NULL)
+    *buf = '\0';
+  fclose(f);
+  buf[strcspn(buf, "\n")] = '\0';
+  return true;
+}
+
+static bool add_file(cpu_set_t *mask, const char *path, bool optional) {
+  char list[4096];
+
+  return read_line(path, list, sizeof list, optional) && add_list(mask, list);
+}
+
+static bool add_isolated(cpu_set_t *mask) {
+  char path[64];
+
+  snprintf(path, sizeof path, "%s/isolated", cpu_dir);
+  if (!add_file(mask, path, true))
+    return false;
+  snprintf(path, sizeof path, "%s/nohz_full", cpu_dir);
+  return add_file(mask, path, true);
+}
+
+/* The cache shared by most CPUs is the last level cache */
+int topology_llc(int cpu) {
+  char path[96];
+  char level[16];
+  char llc_id[16];
+  int best_level = -1;
+  int index;
+
+  *llc_id = '\0';
+  for (index = 0; ; index++) {
+    snprintf(path, sizeof path, "%s/cpu%d/cache/index%d/level", cpu_dir, cpu, index);
+    if (!read_line(path, level, sizeof level, true) || *level == '\0')
+      break;
+    if (atoi(level) <= best_level)
+      continue;
+    best_level = atoi(level);
+    snprintf(path, sizeof path, "%s/cpu%d/cache/index%d/id", cpu_dir, cpu, index);
+    read_line(path, llc_id, sizeof llc_id, true);
+  }
+  return *llc_id ? atoi(llc_id) : -1;
+}
+
+static bool add_llc(cpu_set_t *mask, int id) {
+  int cpu;
+
+  for (cpu = 0; cpu < num_cpus; cpu++)
+    if (topology_llc(cpu) == id)
+      CPU_SET_S(cpu, mask_size, mask);
+  return true;
+}
+
+/* The first thread of each online core */
+static bool add_cores(cpu_set_t *mask) {
+  cpu_set_t *online;
+  char path[96];
+  char value[64];
+  int cpu;
+
+  if ((online = new_mask()) == NULL)
+    return false;
+  snprintf(path, sizeof path, "%s/online", cpu_dir);
+  if (!add_file(online, path, false)) {
+    CPU_FREE(online);
+    return false;
+  }
+  for (cpu = 0; cpu < num_cpus; cpu++) {
+    if (!CPU_ISSET_S(cpu, mask_size, online))
+      continue;
+    snprintf(path, sizeof path, "%s/cpu%d/topology/thread_siblings_list", cpu_dir, cpu);
+    if (read_line(path, value, sizeof value, true) &&
+        (*value == '\0' || atoi(value) == cpu))
+      CPU_SET_S(cpu, mask_size, mask);
+  }
+  CPU_FREE(online);
+  return true;
+}
+
+/* Resolve a single selector or numeric range */
+static bool add_term(cpu_set_t *mask, char *term) {
+  cpu_set_t *isolated;
+  char path[64];
+  char *arg;
+  char *end;
+  bool ok;
+  int n = 0;
+
+  if (isdigit((unsigned char) *term))
+    return add_list(mask, term);
+
+  if ((arg = strchr(term, ':'))) {
+    *arg++ = '\0';
+    n = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || n < 0)
+      goto invalid;
+  }
+
+  if (!strcmp(term, "node") && arg) {
+    snprintf(path, sizeof path, "%s/node%d/cpulist", node_dir, n);
+    return add_file(mask, path, false);
+  } else if (!strcmp(term, "llc") && arg) {
+    return add_llc(mask, n);
+  } else if (arg) {
+    goto invalid;
+  } else if (!strcmp(term, "cores")) {
+    return add_cores(mask);
+  } else if (!strcmp(term, "online")) {
+    snprintf(path, sizeof path, "%s/online", cpu_dir);
+    return add_file(mask, path, false);
+  } else if (!strcmp(term, "isolated")) {
+    return add_isolated(mask);
+  } else if (!strcmp(term, "housekeeping")) {
+    if ((isolated = new_mask()) == NULL)
+      return false;
+    snprintf(path, sizeof path, "%s/online", cpu_dir);
+    ok = add_file(mask, path, false) && add_isolated(isolated);
+    if (ok)
+      for (n = 0; n < num_cpus; n++)
+        if (CPU_ISSET_S(n, mask_size, isolated))
+          CPU_CLR_S(n, mask_size, mask);
+    CPU_FREE(isolated);
+    return ok;
+  }
+
+invalid:
+  fprintf(stderr, "unknown CPU selector: %s%s%s\n", term, arg ? ":" : "", arg ? arg : "");
+  return false;
+}
+
+/* Identify the physical core of a CPU by its first thread */
+int topology_core(int cpu) {
+  char path[96];
+  char value[64];
+
+  snprintf(path, sizeof path, "%s/cpu%d/topology/thread_siblings_list", cpu_dir, cpu);
+  if (!read_line(path, value, sizeof value, true) || *value == '\0')
+    return cpu;
+  return atoi(value);
+}
+
+bool topology_selector(const char *spec) {
+  for (; *spec; spec++)
+    if (isalpha((unsigned char) *spec))
+      return true;
+  return false;
+}
+
+/* Expand a CPU list containing topology selectors into a plain list.
+ * Comma-separated items are combined and items joined by '&' are
+ * intersected, such as "node:1&cores" for one thread per core of the
+ * second node. */
+char *topology_expand(const char *spec) {
+  struct cpu_mask result = {};
+  cpu_set_t *item = NULL;
+  cpu_set_t *term = NULL;
+  char *copy = strdupa(spec);
+  char *list = NULL;
+  char *terms;
+  char *tok;
+
+  num_cpus = get_nprocs_conf();
+  mask_size = CPU_ALLOC_SIZE(num_cpus);
+  if ((result.mask = new_mask()) == NULL ||
+      (item = new_mask()) == NULL ||
+      (term = new_mask()) == NULL)
+    goto done;
+  result.size = mask_size;
+
+  while ((terms = strsep(&copy, ","))) {
+    CPU_ZERO_S(mask_size, item);
+    tok = strsep(&terms, "&");
+    if (!add_term(item, tok))
+      goto done;
+    while ((tok = strsep(&terms, "&"))) {
+      CPU_ZERO_S(mask_size, term);
+      if (!add_term(term, tok))
+        goto done;
+      CPU_AND_S(mask_size, item, item, term);
+    }
+    CPU_OR_S(mask_size, result.mask, result.mask, item);
+  }
+
+  if (CPU_COUNT_S(mask_size, result.mask) == 0)
+    fprintf(stderr, "no CPUs selected by %s\n", spec);
+  else
+    list = format_cpus(&result);
+
+done:
+  if (term)
+    CPU_FREE(term);
+  if (item)
+    CPU_FREE(item);
+  if (result.mask)
+    CPU_FREE(result.mask);
+  return list;
+}
@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2025 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _TOPOLOGY_H
+#define _TOPOLOGY_H
+
+extern bool topology_selector(const char *spec);
+extern char *topology_expand(const char *spec);
+extern int topology_core(int cpu);
+extern int topology_llc(int cpu);
+
+#endif
@@ -23,15 +23,20 @@
 #include <unistd.h>
 #include <linux/prctl.h>
 #include <linux/ioprio.h>
+#include <linux/sched.h>
+#include <net/if.h>
 #include <sys/file.h>
 #include <sys/dir.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/pidfd.h>
 #include <sys/prctl.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <sys/syscall.h>
 
 #include "xchpst.h"
@@ -42,6 +47,13 @@
 #include "rootfs.h"
 #include "mount.h"
 #include "precreate.h"
+#include "cgroup.h"
+#include "psi.h"
+#include "slots.h"
+#include "schedule.h"
+#include "numa.h"
+#include "cpualloc.h"
+#include "sysctl.h"
 
 static const char *version_str = STRINGIFY(PROG_VERSION);
 #ifdef PROG_DEFAULT
@@ -102,8 +114,40 @@ int ensure_dir(int dirfd, const char *path, int *fd, mode_t mode) {
   return 0;
 }
 
+/* Identify a process by its start time as well as its PID, which may
+ * be reused once it exits */
+bool process_start_time(pid_t pid, unsigned long long *start) {
+  char path[32];
+  char stat[1024];
+  char *fields;
+  char state;
+  size_t len;
+  FILE *f;
+
+  snprintf(path, sizeof path, "/proc/%d/stat", pid);
+  f = fopen(path, "re");
+  if (f == NULL)
+    return false;
+  len = fread(stat, 1, sizeof stat - 1, f);
+  fclose(f);
+  stat[len] = '\0';
+
+  /* The command name may itself contain spaces and parentheses */
+  fields = strrchr(stat, ')');
+  if (fields == NULL ||
+      sscanf(fields + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+             " %*d %*d %*d %*d %*d %*d %llu", &state, start) != 2)
+    return false;
+  return state != 'Z' && state != 'X';
+}
+
 int get_run_dir(void) {
-  int rc = ensure_dir(-1, std_run_dir, &run_dir_fd, 0700);
+  int rc;
+
+  if (run_dir_fd != -1)
+    return run_dir_fd;
+
+  rc = ensure_dir(-1, std_run_dir, &run_dir_fd, 0700);
   if (rc == -1) {
     char *xdg_run_dir = getenv("XDG_RUNTIME_DIR");
     if (xdg_run_dir) {
@@ -128,7 +172,7 @@ int get_run_dir(void) {
   return run_dir_fd;
 }
 
-static int write_once(const char *file, const char *fmt, ...) {
+int write_once(const char *file, const char *fmt, ...) {
   int fd = open(file, O_WRONLY);
   char *text;
   ssize_t len;
@@ -159,6 +203,37 @@ fail0:
   return rc;
 }
 
+/* Milliseconds on the monotonic clock since an earlier reading of it,
+ * or since its origin if there is none */
+long long elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (since == NULL)
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000LL;
+  return (now.tv_sec - since->tv_sec) * 1000LL +
+         (now.tv_nsec - since->tv_nsec) / 1000000LL;
+}
+
+static int loopback_up(void) {
+  struct ifreq ifr = { .ifr_name = "lo" };
+  int fd;
+  int rc = -1;
+
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd != -1) {
+    if ((rc = ioctl(fd, SIOCGIFFLAGS, &ifr)) == 0) {
+      ifr.ifr_flags |= IFF_UP;
+      rc = ioctl(fd, SIOCSIFFLAGS, &ifr);
+    }
+    close(fd);
+  }
+  if (rc == -1)
+    fprintf(stderr, "warning: could not bring up loopback interface, %s\n",
+            strerror(errno));
+  return rc;
+}
+
 void set_rlimit(int resource, struct limit *option) {
   struct rlimit prev;
 
@@ -251,6 +326,85 @@ bool drop_user(uid_t uid, gid_t gid) {
   return true;
 }
 
+/* Fork a child to be supervised by join(). All signals are blocked
+ * in the parent so we can get them delivered by signalfd, saving the
+ * old mask for re-use by the child. */
+static pid_t fork_for_join(uint64_t flags, int cgroup_fd, int *pidfd,
+                           sigset_t *newmask, sigset_t *oldmask) {
+  pid_t child;
+
+  sigfillset(newmask);
+  if (!set(OPT_REAP))
+    sigdelset(newmask, SIGCHLD);
+  sigdelset(newmask, SIGBUS);
+  sigdelset(newmask, SIGFPE);
+  sigdelset(newmask, SIGILL);
+  sigdelset(newmask, SIGSEGV);
+  if (sigprocmask(SIG_SETMASK, newmask, oldmask) == -1) {
+    perror("setting up mask for signalfds");
+    return -1;
+  }
+
+  child = launch(flags, cgroup_fd, pidfd);
+  if (child == 0) {
+    if (sigprocmask(SIG_SETMASK, oldmask, NULL) == -1)
+      perror("warning: could not restore signal mask in child");
+  }
+
+  /* Both sides set the process group so that it exists before any
+   * signal is passed on to it. */
+  if (child != -1 && set(OPT_SIGNAL_GROUP) &&
+      setpgid(child, child) == -1 && child == 0)
+    perror("warning: could not create process group");
+
+  return child;
+}
+
+/* Replace this process with a fresh image of ourselves that does
+ * nothing but join the child, shedding the memory held for options,
+ * name service lookups, libcap and the rest. The blocked signal mask
+ * and subreaper status survive the exec. */
+static void exec_join_helper(pid_t child, int pidfd, bool supervise,
+                             int cgroup_fd, int ready_fd) {
+  char join_arg[64];
+  char **args;
+  int argc = 0;
+  int v, i;
+
+  args = calloc(8 + opt.num_supervisor_args, sizeof *args);
+  if (args == NULL ||
+      fcntl(pidfd, F_SETFD, 0) == -1 ||
+      (cgroup_fd != -1 && fcntl(cgroup_fd, F_SETFD, 0) == -1) ||
+      (ready_fd != -1 && fcntl(ready_fd, F_SETFD, 0) == -1))
+    goto fail;
+
+  snprintf(join_arg, sizeof join_arg, "%d:%d:%d:%d",
+           child, pidfd, cgroup_fd, ready_fd);
+  args[argc++] = NAME_STR;
+  for (v = 0; v < opt.verbosity && v < LOG_LEVEL_DEBUG; v++)
+    args[argc++] = "-v";
+  if (set(OPT_REAP))
+    args[argc++] = "--reap";
+  if (set(OPT_SIGNAL_GROUP))
+    args[argc++] = "--signal-group";
+  for (i = 0; supervise && i < opt.num_supervisor_args; i++)
+    args[argc++] = opt.supervisor_args[i];
+  args[argc++] = "--join";
+  args[argc++] = join_arg;
+  args[argc] = NULL;
+
+  execv("/proc/self/exe", args);
+
+fail:
+  perror("warning: could not exec lean join helper");
+  fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+  if (cgroup_fd != -1)
+    fcntl(cgroup_fd, F_SETFD, FD_CLOEXEC);
+  if (ready_fd != -1)
+    fcntl(ready_fd, F_SETFD, FD_CLOEXEC);
+  free(args);
+}
+
 static const struct app *find_app(const char *name) {
   const struct app *app;
   const char *ext = strchrnul(name, '.');
@@ -270,12 +424,19 @@ int main(int argc, char *argv[]) {
   char *new_root = NULL;
   char *old_root = NULL;
   int sub_argc;
-  pid_t child;
+  pid_t child = 0;
   int optind;
   int rc = 0;
   int ret = CHPST_ERROR_CHANGING_STATE;
   int lock_fd = -1;
+  int slots_fd = -1;
+  int cgroup_fd = -1;
+  int ready_pipe[2] = { -1, -1 };
+  int pidfd = -1;
   bool in_new_root = false;
+  bool detached = false;
+  bool nested_supervisor;
+  bool defer_sched;
   uid_t uid;
   gid_t gid;
   int fd;
@@ -293,15 +454,55 @@ int main(int argc, char *argv[]) {
   if (is_verbose())
     fprintf(stderr, "invoked as %s(%s)\n", opt.app->name, program_invocation_short_name);
 
-  if (!set(OPT_FORK_JOIN) &&
+  /* Lean join helper, as exec'd by ourselves */
+  if (set(OPT_JOIN)) {
+    if (opt.error ||
+        pidfd_send_signal(opt.join_pidfd, 0, NULL, 0) == -1) {
+      fprintf(stderr, "no child to join\n");
+      ret = CHPST_ERROR_OPTIONS;
+    } else {
+      sigprocmask(SIG_SETMASK, NULL, &newmask);
+      if (opt.join_cgroup_fd != -1) {
+        cgroup_supervise(opt.join_cgroup_fd, opt.join_ready_fd);
+        cgroup_boost();
+      }
+      psi_watch(opt.join_cgroup_fd);
+      join(opt.join_child, opt.join_pidfd, &newmask, &newmask, &ret);
+      cgroup_report_events();
+    }
+    goto finish0;
+  }
+
+  if (set(OPT_FORK_JOIN) && set(OPT_DETACH)) {
+    fprintf(stderr, "cannot both join and detach from child\n");
+    opt.error = true;
+  }
+
+  /* The lean helper never returns here to take down a new root */
+  if (set(OPT_LEAN_JOIN) && set(OPT_NEW_ROOT)) {
+    fprintf(stderr, "--lean-join cannot clean up after --new-root\n");
+    opt.error = true;
+  }
+
+  if (!set(OPT_FORK_JOIN) && !set(OPT_DETACH) &&
       (opt.new_ns & CLONE_NEWPID)) {
     if (is_verbose())
       fprintf(stderr, "also going to do fork-join since new PID namespace requested\n");
     enable(OPT_FORK_JOIN);
   }
 
+  if (!set(OPT_FORK_JOIN) && !set(OPT_DETACH) &&
+      (set(OPT_REAP) || set(OPT_SIGNAL_GROUP) || set(OPT_MEMORY_RECLAIM) ||
+       opt.num_pressure_watches ||
+       opt.startup_cpu_weight || opt.startup_io_weight)) {
+    if (is_verbose())
+      fprintf(stderr, "also going to do fork-join to supervise child\n");
+    enable(OPT_FORK_JOIN);
+  }
+
   if (!(opt.new_ns & CLONE_NEWNS) &&
       (set(OPT_NET_NS) || set(OPT_PRIVATE_RUN) || set(OPT_PRIVATE_TMP) ||
+       set(OPT_PRIVATE_SHM) ||
        set(OPT_RO_SYS) || set(OPT_RO_HOME) || set(OPT_RO_ETC) ||
        set(OPT_NEW_ROOT) || set(OPT_PID_NS))) {
     if (is_verbose())
@@ -309,6 +510,94 @@ int main(int argc, char *argv[]) {
     opt.new_ns |= CLONE_NEWNS;
   }
 
+  if (!opt.cgroup &&
+      (cgroup_controls_requested() || set(OPT_CGROUP_DELEGATE) ||
+       set(OPT_MEMORY_RECLAIM) || set(OPT_READY_FD))) {
+    fprintf(stderr, "cgroup resource controls need --cgroup\n");
+    opt.error = true;
+  }
+
+  if ((opt.startup_cpu_weight || opt.startup_io_weight) &&
+      !set(OPT_STARTUP_BOOST) && !set(OPT_READY_FD)) {
+    fprintf(stderr, "startup weights need --startup-boost or --ready-fd\n");
+    opt.error = true;
+  }
+
+  for (int i = 0; i < opt.num_pressure_watches; i++) {
+    if (opt.pressure_watches[i].action == PRESSURE_THROTTLE && !opt.cgroup) {
+      fprintf(stderr, "pressure throttle needs --cgroup\n");
+      opt.error = true;
+    }
+  }
+
+  if ((set(OPT_SLOTS_TRY) || set(OPT_SLOTS_FAIR)) && !opt.slots_file) {
+    fprintf(stderr, "slot options need --slots\n");
+    opt.error = true;
+  }
+
+  if (set(OPT_WAIT_TIMEOUT) && opt.num_wait_conditions == 0) {
+    fprintf(stderr, "--wait-timeout needs --wait-resources\n");
+    opt.error = true;
+  }
+
+  if (opt.cpus_spread && !opt.cpus_auto) {
+    fprintf(stderr, "--cpus-spread needs --cpus auto:N\n");
+    opt.error = true;
+  }
+
+  if (opt.uclamp_min && opt.uclamp_max &&
+      opt.uclamp_min_util > opt.uclamp_max_util) {
+    fprintf(stderr, "--uclamp-min cannot exceed --uclamp-max\n");
+    opt.error = true;
+  }
+
+  nested_supervisor = set(OPT_RESPAWN) ||
+                      (set(OPT_REAP) && (opt.new_ns & CLONE_NEWPID));
+
+  /* Utilisation clamps go with any policy, otherwise keeping the
+   * current one */
+  if (opt.uclamp_min || opt.uclamp_max) {
+    if (!set(OPT_CPU_SCHED))
+      opt.sched_attr = (struct sched_attributes) {
+        .size = sizeof opt.sched_attr,
+        .sched_flags = SCHED_FLAG_KEEP_ALL,
+      };
+    if (opt.uclamp_min) {
+      opt.sched_attr.sched_flags |= SCHED_FLAG_UTIL_CLAMP_MIN;
+      opt.sched_attr.sched_util_min = opt.uclamp_min_util;
+    }
+    if (opt.uclamp_max) {
+      opt.sched_attr.sched_flags |= SCHED_FLAG_UTIL_CLAMP_MAX;
+      opt.sched_attr.sched_util_max = opt.uclamp_max_util;
+    }
+  }
+
+  /* A deadline task may not fork and a reset-on-fork policy would not
+   * pass to the child, so leave these to the child. A nested supervisor
+   * forks again after dropping privileges, too late to apply them. */
+  defer_sched = (opt.sched_attr.sched_policy == SCHED_DEADLINE ||
+                 opt.sched_attr.sched_flags & SCHED_FLAG_RESET_ON_FORK) &&
+                (set(OPT_FORK_JOIN) || set(OPT_DETACH) || nested_supervisor);
+  if (defer_sched && nested_supervisor) {
+    fprintf(stderr, "deadline and reset-on-fork scheduling cannot be used "
+            "with --respawn or --reap in a PID namespace\n");
+    opt.error = true;
+  }
+
+  /* A nested supervisor applies its own state after dropping privileges
+   * and must then be able to undo it for each respawned child */
+  if (nested_supervisor &&
+      (geteuid() != 0 || set(OPT_SETUIDGID) || opt.caps_op != CAP_OP_NONE) &&
+      !supervisor_state_reversible()) {
+    fprintf(stderr, "supervisor scheduling could not be undone for respawned "
+            "children without privileges\n");
+    opt.error = true;
+  }
+
+  if (opt.num_sysctls &&
+      !sysctls_check(opt.new_ns | (opt.net_adopt ? CLONE_NEWNET : 0)))
+    opt.error = true;
+
   if (opt.exit) {
     ret = opt.error ? CHPST_ERROR_OPTIONS : opt.retcode;
     goto finish0;
@@ -354,6 +643,20 @@ int main(int argc, char *argv[]) {
   if (set(OPT_OOM))
     write_once("/proc/self/oom_score_adj", "%ld", opt.oom_adjust);
 
+  if (opt.slots_file && (slots_fd = slots_acquire()) == -1) {
+    if (opt.lock_quiet)
+      ret = CHPST_ERROR_EXIT;
+    else if (errno == EAGAIN)
+      fprintf(stderr, "no free slot in %s\n", opt.slots_file);
+    else
+      fprintf(stderr, "error obtaining slot, %s\n", strerror(errno));
+    goto finish;
+  }
+
+  /* Hold back until the system has room for another service */
+  if (opt.num_wait_conditions && psi_wait_resources() == -1)
+    goto finish;
+
   if (opt.lock_file) {
     if (opt.lock_nowait_override)
       opt.lock_wait = false;
@@ -418,6 +721,25 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  /* The autogroup belongs to the whole session, so leave our caller's
+   * alone unless we lead a session of our own */
+  if (set(OPT_AUTOGROUP_NICE)) {
+    if (getsid(0) != getpid()) {
+      if (!opt.autogroup_quiet)
+        fprintf(stderr, "warning: not setting autogroup niceness "
+                "outside a session of our own, see -P\n");
+    } else if (write_once("/proc/self/autogroup", "%d", opt.autogroup_nice) == 0 &&
+             is_verbose())
+      fprintf(stderr, "set autogroup niceness to %d\n", opt.autogroup_nice);
+  }
+
+  if (set(OPT_CORE_SCHED) && core_sched_apply() == -1)
+    goto finish;
+
+  if (set(OPT_TIMER_SLACK) &&
+      prctl(PR_SET_TIMERSLACK, opt.timer_slack, 0L, 0L, 0L) == -1)
+    perror("could not set timer slack");
+
   if (set(OPT_IO_SCHED)) {
     if (syscall(SYS_ioprio_set,IOPRIO_WHO_PROCESS, 0, opt.ionice_prio) == -1) {
       fprintf(stderr, "warning: failed to set I/O scheduling class\n");
@@ -428,14 +750,24 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  /* Memory policy persists across execve(2), and may choose CPUs */
+  if (opt.numa_policy && numa_apply() == -1)
+    goto finish;
+
+  if (opt.cpus_auto && cpualloc_auto() == -1)
+    goto finish;
+
+  if (opt.cpus_exclusive && cpualloc_exclusive() == -1)
+    goto finish;
+
   if (opt.cpu_affinity.size &&
       sched_setaffinity(0, opt.cpu_affinity.size,
                         opt.cpu_affinity.mask) == -1)
     perror("could not set CPU affinity");
 
-  if (set(OPT_CPU_SCHED) &&
-      sched_setscheduler(0, opt.sched_policy, &((struct sched_param) {})) == -1)
-    perror("could not change scheduler policy");
+  if (opt.sched_attr.size && !defer_sched &&
+      sched_apply(&opt.sched_attr, "process") == -1)
+    goto finish;
 
   if ((opt.cap_bounds_op != CAP_OP_NONE ||
        opt.caps_op != CAP_OP_NONE) &&
@@ -495,6 +827,27 @@ int main(int argc, char *argv[]) {
   if (opt.app_name == NULL)
     opt.app_name = basename(sub_argv[0]);
 
+  /* Open the cgroup while the host filesystem is still in view */
+  if (opt.cgroup &&
+      ((cgroup_fd = cgroup_open(opt.cgroup)) == -1 ||
+       cgroup_configure(cgroup_fd) == -1 ||
+       (set(OPT_CGROUP_DELEGATE) &&
+        cgroup_delegate(cgroup_fd, uid, gid) == -1)))
+    goto finish;
+
+  /* The child may say when it is ready, ending any startup boost */
+  if (set(OPT_READY_FD) &&
+      (pipe2(ready_pipe, O_CLOEXEC) == -1 ||
+       fcntl(ready_pipe[0], F_SETFL, O_NONBLOCK) == -1)) {
+    perror("could not create readiness pipe");
+    goto finish;
+  }
+
+  /* Look after the cgroup while the child runs, noting memory events
+   * so far to report those caused by the child */
+  if (cgroup_fd != -1)
+    cgroup_supervise(cgroup_fd, ready_pipe[0]);
+
   {
     uid_t o = set(OPT_SETUIDGID) ? uid : (uid_t) -1;
     gid_t g = set(OPT_SETUIDGID) ? gid : (gid_t) -1;
@@ -524,7 +877,8 @@ int main(int argc, char *argv[]) {
       goto finish;
 
   if (opt.new_ns) {
-    rc = unshare(opt.new_ns);
+    /* A new PID namespace is requested at clone time with --fork-join */
+    rc = unshare(opt.new_ns & ~CLONE_NEWPID);
     if (rc == -1) {
       perror(NAME_STR ": unshare()");
       goto finish;
@@ -538,8 +892,10 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "recursive remounting / as MS_SLAVE: %s", strerror(errno));
     }
 
-    if (opt.new_ns & CLONE_NEWNET)
+    if (opt.new_ns & CLONE_NEWNET) {
       special_mount("/sys", "sysfs", "sysfs", NULL);
+      loopback_up();
+    }
   }
 
   if (opt.new_ns & CLONE_NEWUSER) {
@@ -572,6 +928,9 @@ int main(int argc, char *argv[]) {
     if (opt.verbosity > 0) fprintf(stderr, "adopted net ns\n");
   }
 
+  if (apply_sysctls() == -1)
+    goto finish;
+
   if (set(OPT_NEW_ROOT)) {
     if (!create_new_root(basename(executable), &new_root, &old_root))
       goto finish;
@@ -580,36 +939,46 @@ int main(int argc, char *argv[]) {
   set_resource_limits();
 
   if (set(OPT_FORK_JOIN)) {
-    /* Save old signal mask for re-use by child and block all signals
-     * in the parent so we can get them delivered by signalfd. */
-    sigfillset(&newmask);
-    sigdelset(&newmask, SIGCHLD);
-    sigdelset(&newmask, SIGBUS);
-    sigdelset(&newmask, SIGFPE);
-    sigdelset(&newmask, SIGILL);
-    sigdelset(&newmask, SIGSEGV);
-    rc = sigprocmask(SIG_SETMASK, &newmask, &oldmask);
-    if (rc == -1) {
-      perror("setting up mask for signalfds");
-      goto finish;
-    }
+    if (set(OPT_REAP) && prctl(PR_SET_CHILD_SUBREAPER, 1) == -1)
+      perror("warning: could not become child subreaper");
 
-    child = fork();
+    child = fork_for_join(opt.new_ns & CLONE_NEWPID, cgroup_fd, &pidfd,
+                          &newmask, &oldmask);
+    if (child == -1)
+      goto finish;
+    else if (child != 0)
+      goto join;
+  } else if (set(OPT_DETACH)) {
+    /* Hand the child to our own parent to supervise and get out of
+     * the way. The child shares our mount namespace so any new root
+     * must be left for it to clean up. */
+    child = launch((opt.new_ns & CLONE_NEWPID) | CLONE_PARENT,
+                   cgroup_fd, &pidfd);
     if (child == -1) {
-      perror("fork");
       goto finish;
     } else if (child != 0) {
-      goto join;
-    } else {
-      if (sigprocmask(SIG_SETMASK, &oldmask, NULL) == -1)
-        perror("warning: could not restore signal mask in child");
+      close(pidfd);
+      if (opt.cpus_exclusive)
+        cpualloc_transfer(child);
+      if (opt.core_sched_group)
+        core_sched_transfer(child);
+      detached = true;
+      ret = 0;
+      goto finish;
     }
+  } else if (cgroup_fd != -1 && cgroup_enter(cgroup_fd) == -1) {
+    goto finish;
   }
 
   /*************************************
    *  Inside child if fork-join used   *
    *************************************/
 
+  /* A nested supervisor watches pressure while it can still open the
+   * cgroup's files, before any privileges are dropped below */
+  if (nested_supervisor)
+    psi_watch(cgroup_fd);
+
   if (set(OPT_NEW_ROOT)) {
     if (!pivot_to_new_root(new_root, old_root))
       goto finish;
@@ -655,6 +1024,10 @@ int main(int argc, char *argv[]) {
        private_mount("/var/tmp") == -1))
     goto finish;
 
+  if (set(OPT_PRIVATE_SHM) &&
+      private_shm_mount(opt.shm_size) == -1)
+    goto finish;
+
   if (set(OPT_PROTECT_HOME) &&
       (private_mount("/home") == -1 ||
        private_mount("/root") == -1 ||
@@ -675,6 +1048,10 @@ int main(int argc, char *argv[]) {
       (remount_ro("/etc") == -1))
     goto finish;
 
+  if (defer_sched &&
+      sched_apply(&opt.sched_attr, "process") == -1)
+    goto finish;
+
   if (set(OPT_SETUIDGID) &&
       (opt.new_ns & CLONE_NEWUSER) == 0 &&
       opt.users_groups.user.resolved &&
@@ -685,6 +1062,42 @@ int main(int argc, char *argv[]) {
     if (!drop_capabilities())
       goto finish;
 
+  /* Orphans in a PID namespace are inherited by its PID 1, so stay
+   * on as PID 1 to reap them and run the target in a further child.
+   * Respawning likewise re-runs only the final stage, keeping all the
+   * process state prepared above. */
+  if (nested_supervisor) {
+    struct timespec started;
+
+    do {
+      clock_gettime(CLOCK_MONOTONIC, &started);
+      child = fork_for_join(0, -1, &pidfd, &newmask, &oldmask);
+      /* Leave the cleanup to the supervisor */
+      if (child == 0 && !leave_supervisor_state())
+        _exit(CHPST_ERROR_CHANGING_STATE);
+      if (child <= 0)
+        break;
+      enter_supervisor_state();
+      cgroup_boost();
+      join(child, pidfd, &newmask, &oldmask, &ret);
+      cgroup_report_events();
+    } while (set(OPT_RESPAWN) && respawn(ret, &started, &newmask, &oldmask));
+
+    if (child != 0)
+      goto finish;
+  }
+
+  if (ready_pipe[1] != -1) {
+    if (ready_pipe[1] == opt.ready_fd)
+      fcntl(opt.ready_fd, F_SETFD, 0);
+    else if (dup2(ready_pipe[1], opt.ready_fd) == -1)
+      perror("could not set up readiness fd");
+    else
+      close(ready_pipe[1]);
+    if (ready_pipe[0] != opt.ready_fd)
+      close(ready_pipe[0]);
+  }
+
   for (unsigned int close_fds = opt.close_fds; close_fds; close_fds &= ~(1 << fd))
     close(fd = /*stdc_trailing_zeros*/ __builtin_ctz(close_fds));
 
@@ -699,8 +1112,29 @@ int main(int argc, char *argv[]) {
   perror(NAME_STR ": execvp");
 
 join:
-  if (set(OPT_FORK_JOIN) && child != 0)
-    join(child, &newmask, &oldmask, &ret);
+  if (child > 0) {
+    /* Only the child writes, so that its exit is seen as EOF */
+    if (ready_pipe[1] != -1) {
+      close(ready_pipe[1]);
+      ready_pipe[1] = -1;
+    }
+
+    enter_supervisor_state();
+
+    /* A nested supervisor looks after the cgroup for each run */
+    if (nested_supervisor)
+      cgroup_supervise(-1, -1);
+    else
+      cgroup_boost();
+    if (set(OPT_LEAN_JOIN))
+      exec_join_helper(child, pidfd, !nested_supervisor,
+                       nested_supervisor ? -1 : cgroup_fd,
+                       nested_supervisor ? -1 : ready_pipe[0]);
+    if (!nested_supervisor)
+      psi_watch(cgroup_fd);
+    join(child, pidfd, &newmask, &oldmask, &ret);
+    cgroup_report_events();
+  }
 
 finish:
   /* Actions here should be
@@ -709,7 +1143,7 @@ finish:
      3) not be necessary when --fork-join is not used.
    */
 
-  if (new_root && !in_new_root) {
+  if (new_root && !in_new_root && !detached) {
     if (umount2(new_root, MNT_DETACH) == -1)
       fprintf(stderr, "umount2(%s): %s\n", new_root, strerror(errno));
     if (rmdir(new_root) == -1)
@@ -722,6 +1156,15 @@ finish:
 
   if (lock_fd != -1)
     close(lock_fd);
+  if (slots_fd != -1)
+    close(slots_fd);
+
+  if (ready_pipe[0] != -1)
+    close(ready_pipe[0]);
+  if (ready_pipe[1] != -1)
+    close(ready_pipe[1]);
+  if (cgroup_fd != -1)
+    close(cgroup_fd);
 
   free(new_root);
   free(old_root);
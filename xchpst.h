@@ -20,6 +20,8 @@ enum chpst_exit {
 
 #include "options.h"
 
+struct timespec;
+
 #define NAME_STR STRINGIFY(PROG_NAME)
 
 /* Support levels determined at runtime */
@@ -34,5 +36,8 @@ extern char *run_dir;
 
 extern int ensure_dir(int dirfd, const char *path, int *fd, mode_t mode);
 extern int get_run_dir(void);
+extern bool process_start_time(pid_t pid, unsigned long long *start);
+extern int write_once(const char *file, const char *fmt, ...);
+extern long long elapsed_ms(const struct timespec *since);
 
 #endif